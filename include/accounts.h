@@ -0,0 +1,140 @@
+#ifndef accounts_h
+#define accounts_h
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "globals.h"
+
+// 64-bit mix (murmur3 finalizer) used to spread account ids over the table.
+std::uint64_t HashAccountId(std::uint64_t id) {
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  id *= 0xc4ceb9fe1a85ec53ULL;
+  id ^= id >> 33;
+  return id;
+}
+
+// Map from account id to its User record, built for millions of accounts.
+// The index is an open addressing (linear probing) array of 16-byte
+// (id, record number) slots, so a lookup touches one or two cache lines no
+// matter how many accounts exist. Records live in a std::deque, which keeps
+// them compact in large blocks and never moves one once created, so
+// pointers returned by Find/Insert stay valid until the account is removed.
+// Removed records are recycled by later inserts.
+class AccountTable {
+public:
+  AccountTable() : slots_(kInitialCapacity) {}
+
+  std::size_t size() const { return records_.size() - free_records_.size(); }
+
+  // Returns the account with id, or nullptr if it was never created.
+  User *Find(std::uint64_t id) {
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = HashAccountId(id) & mask;
+         slots_[i].record != kEmptySlot; i = (i + 1) & mask) {
+      if (slots_[i].id == id)
+        return &records_[slots_[i].record];
+    }
+    return nullptr;
+  }
+
+  // Starts loading the index slot of id, so a Find shortly after does not
+  // wait on memory.
+  void Prefetch(std::uint64_t id) const {
+    __builtin_prefetch(&slots_[HashAccountId(id) & (slots_.size() - 1)]);
+  }
+
+  // Creates account id from user and returns it, or returns nullptr without
+  // changing anything if id already exists.
+  User *Insert(std::uint64_t id, const User &user) {
+    if ((size() + 1) * 4 > slots_.size() * 3)
+      Grow();
+    const std::size_t mask = slots_.size() - 1;
+    std::size_t i = HashAccountId(id) & mask;
+    for (; slots_[i].record != kEmptySlot; i = (i + 1) & mask) {
+      if (slots_[i].id == id)
+        return nullptr;
+    }
+    slots_[i].id = id;
+    if (!free_records_.empty()) {
+      slots_[i].record = free_records_.back();
+      free_records_.pop_back();
+      records_[slots_[i].record] = user;
+      return &records_[slots_[i].record];
+    }
+    slots_[i].record = (std::uint32_t)records_.size();
+    records_.push_back(user);
+    return &records_.back();
+  }
+
+  // Calls f(id, user) for every account, in no particular order.
+  template <typename F> void ForEach(F f) const {
+    for (const auto &slot : slots_) {
+      if (slot.record != kEmptySlot)
+        f(slot.id, records_[slot.record]);
+    }
+  }
+
+  // Deletes account id, returning false if it does not exist. Entries after
+  // it in the probe run are shifted back into the gap (no tombstones), so
+  // lookups stay as short as if id had never been inserted.
+  bool Remove(std::uint64_t id) {
+    const std::size_t mask = slots_.size() - 1;
+    std::size_t hole = HashAccountId(id) & mask;
+    for (; slots_[hole].record != kEmptySlot; hole = (hole + 1) & mask) {
+      if (slots_[hole].id == id)
+        break;
+    }
+    if (slots_[hole].record == kEmptySlot)
+      return false;
+    free_records_.push_back(slots_[hole].record);
+
+    for (std::size_t i = (hole + 1) & mask; slots_[i].record != kEmptySlot;
+         i = (i + 1) & mask) {
+      // The entry at i may fill the hole if the hole lies on its probe path,
+      // i.e. its home slot is at least as far back as the hole.
+      const std::size_t home = HashAccountId(slots_[i].id) & mask;
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot();
+    return true;
+  }
+
+private:
+  static const std::size_t kInitialCapacity = 16;
+  static const std::uint32_t kEmptySlot = 0xffffffff;
+
+  struct Slot {
+    std::uint64_t id = 0;
+    std::uint32_t record = kEmptySlot;
+  };
+
+  // Doubles the index; records stay where they are.
+  void Grow() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    const std::size_t mask = slots_.size() - 1;
+    for (const auto &slot : old) {
+      if (slot.record == kEmptySlot)
+        continue;
+      std::size_t i = HashAccountId(slot.id) & mask;
+      while (slots_[i].record != kEmptySlot)
+        i = (i + 1) & mask;
+      slots_[i] = slot;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::deque<User> records_;
+  // Records of removed accounts, reused before records_ grows.
+  std::vector<std::uint32_t> free_records_;
+};
+
+#endif
@@ -0,0 +1,144 @@
+#define CATCH_CONFIG_MAIN
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "engine.h"
+#include "globals.h"
+#include "parser.h"
+#include "queue.h"
+#include "reorder.h"
+#include "shards.h"
+#include "writer.h"
+
+// Every operator new in the program, from any thread, bumps this counter, so
+// a test can assert that a stretch of work did not touch the heap.
+std::atomic<std::size_t> allocations(0);
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+// Input lines for account_count accounts followed by count transactions, as
+// producers send them. Times advance a second per transaction and every
+// transaction has an amount of its own, so each one starts a new history
+// group and only expiry keeps an account down to a steady handful of them.
+std::vector<std::string> MakeLines(std::size_t account_count,
+                                   std::size_t count) {
+  std::vector<std::string> lines;
+  char line[256];
+  for (std::size_t i = 1; i <= account_count; ++i) {
+    std::snprintf(line, sizeof(line),
+                  "{\"account\": {\"account-id\": %zu, \"active-card\": true, "
+                  "\"available-limit\": 1000000000}}",
+                  i);
+    lines.push_back(line);
+  }
+  for (std::size_t i = 0; i < count; ++i) {
+    const std::size_t second = i % 60;
+    const std::size_t minute = i / 60 % 60;
+    const std::size_t hour = i / 3600 % 24;
+    std::snprintf(line, sizeof(line),
+                  "{\"transaction\": {\"account-id\": %zu, \"merchant\": "
+                  "\"Merchant with a name longer than SSO %zu\", \"amount\": "
+                  "%zu, \"time\": \"2019-02-13T%02zu:%02zu:%02zu.000Z\"}}",
+                  i * 7919 % account_count + 1, i % 20, i + 1, hour,
+                  minute, second);
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+TEST_CASE("Steady state transactions do not allocate") {
+  const std::vector<std::string> lines = MakeLines(100, 40000);
+  const std::size_t warm = 100 + 20000;
+
+  Engine engine;
+  ResponseWriter writer;
+  Message message;
+  const std::size_t kBatch = 16;
+  Command commands[kBatch];
+  Response responses[kBatch];
+
+  // Decodes, evaluates and renders lines[begin, end) the way main does.
+  auto run = [&](std::size_t begin, std::size_t end) {
+    std::size_t count = 0;
+    for (std::size_t i = begin; i < end; ++i) {
+      if (DecodeCommand(lines[i].data(), lines[i].size(), message,
+                        commands[count]))
+        ++count;
+      if (count == kBatch || (i + 1 == end && count > 0)) {
+        engine.HandleBatch(commands, count, responses);
+        for (std::size_t j = 0; j < count; ++j)
+          writer.AppendResponse(responses[j]);
+        count = 0;
+        if (writer.Full())
+          writer.clear();
+      }
+    }
+  };
+
+  run(0, warm);
+  const std::size_t before = allocations.load();
+  run(warm, lines.size());
+  const std::size_t after = allocations.load();
+  REQUIRE(after - before == 0);
+}
+
+TEST_CASE("Handing work between threads does not allocate") {
+  SECTION("Rings and the reorder buffer") {
+    SpscRing<ShardInput> ring(64);
+    ReorderBuffer<Response> reorder(64);
+    ShardInput in;
+    Response response;
+    const std::size_t before = allocations.load();
+    for (std::uint64_t i = 0; i < 10000; ++i) {
+      in.sequence = i;
+      ring.TryPush(in);
+      ring.TryPop(in);
+      reorder.Put(in.sequence, response);
+      reorder.Pop(response);
+    }
+    REQUIRE(allocations.load() - before == 0);
+  }
+
+  SECTION("Sharded engine after warm-up") {
+    const std::vector<std::string> lines = MakeLines(100, 40000);
+    std::vector<Command> commands;
+    Message message;
+    Command command;
+    for (const auto &line : lines) {
+      if (DecodeCommand(line.data(), line.size(), message, command))
+        commands.push_back(command);
+    }
+
+    // Output goes nowhere; a stream without a buffer just sets badbit.
+    std::ostream discard(nullptr);
+    ShardedEngine engine(3, discard);
+    const std::size_t warm = 100 + 20000;
+    for (std::size_t i = 0; i < warm; ++i)
+      engine.Submit(commands[i]);
+    const std::size_t before = allocations.load();
+    for (std::size_t i = warm; i < commands.size(); ++i)
+      engine.Submit(commands[i]);
+    engine.Finish();
+    REQUIRE(allocations.load() - before == 0);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef arena_h
+#define arena_h
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Bump allocator for data that lives only as long as one message. Allocate
+// hands out consecutive bytes of a block and Reset takes them all back at
+// once, keeping the blocks, so after the first few messages a message costs
+// a pointer reset instead of a malloc/free pair per piece. Nothing is
+// destroyed on Reset: only trivially destructible data belongs here.
+class Arena {
+public:
+  static const std::size_t kDefaultBlockSize = 4096;
+
+  explicit Arena(std::size_t block_size = kDefaultBlockSize)
+      : block_size_(block_size), block_(0), offset_(0) {
+    assert(block_size > 0);
+  }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns size bytes aligned to align, a power of two, valid until the
+  // next Reset.
+  void *Allocate(std::size_t size,
+                 std::size_t align = alignof(std::max_align_t)) {
+    assert(align > 0 && (align & (align - 1)) == 0);
+    for (; block_ < blocks_.size(); ++block_, offset_ = 0) {
+      Block &block = blocks_[block_];
+      const std::size_t begin = (offset_ + align - 1) & ~(align - 1);
+      if (begin <= block.size && size <= block.size - begin) {
+        offset_ = begin + size;
+        return block.data.get() + begin;
+      }
+    }
+    // Blocks come from new[], which aligns them for any fundamental type.
+    Block block;
+    block.size = size > block_size_ ? size : block_size_;
+    block.data.reset(new char[block.size]);
+    blocks_.push_back(std::move(block));
+    offset_ = size;
+    return blocks_[block_].data.get();
+  }
+
+  // Copies size bytes from data into the arena and returns the copy.
+  char *Copy(const char *data, std::size_t size) {
+    char *copy = (char *)Allocate(size, 1);
+    if (size > 0)
+      std::memcpy(copy, data, size);
+    return copy;
+  }
+
+  // Frees everything allocated so far for reuse.
+  void Reset() {
+    block_ = 0;
+    offset_ = 0;
+  }
+
+  // Bytes held in blocks, used or not.
+  std::size_t capacity() const {
+    std::size_t total = 0;
+    for (const auto &block : blocks_)
+      total += block.size;
+    return total;
+  }
+
+private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    std::size_t size;
+  };
+
+  const std::size_t block_size_;
+  std::vector<Block> blocks_;
+  // Block being filled and the first free byte in it.
+  std::size_t block_;
+  std::size_t offset_;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef balance_h
+#define balance_h
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "accounts.h"
+
+// Picks the shard that owns account id by default. Uses the upper half of
+// the hash because AccountTable indexes by the lower bits; routing on those
+// would leave each shard's table using only every shard_count-th slot.
+std::size_t ShardOf(std::uint64_t id, std::size_t shard_count) {
+  return (std::size_t)(((HashAccountId(id) >> 32) * shard_count) >> 32);
+}
+
+// Misra-Gries summary of the most frequent ids in a stream, in K counters.
+// Any id that makes up more than 1/(K + 1) of the stream is guaranteed to
+// hold a counter, and a counter undercounts its id by at most that much.
+template <std::size_t K> class HeavyHitters {
+public:
+  HeavyHitters() { Clear(); }
+
+  void Add(std::uint64_t id) {
+    for (std::size_t i = 0; i < K; ++i) {
+      if (counts_[i] != 0 && ids_[i] == id) {
+        ++counts_[i];
+        return;
+      }
+    }
+    for (std::size_t i = 0; i < K; ++i) {
+      if (counts_[i] == 0) {
+        ids_[i] = id;
+        counts_[i] = 1;
+        return;
+      }
+    }
+    for (std::size_t i = 0; i < K; ++i)
+      --counts_[i];
+  }
+
+  // Stores the id with the highest counter and returns true, or returns
+  // false if nothing was added since the last Clear.
+  bool Top(std::uint64_t &id, std::uint64_t &count) const {
+    count = 0;
+    for (std::size_t i = 0; i < K; ++i) {
+      if (counts_[i] > count) {
+        id = ids_[i];
+        count = counts_[i];
+      }
+    }
+    return count != 0;
+  }
+
+  void Clear() {
+    for (std::size_t i = 0; i < K; ++i)
+      counts_[i] = 0;
+  }
+
+private:
+  std::uint64_t ids_[K];
+  std::uint64_t counts_[K];
+};
+
+// Decides which shard each account lives on. Accounts start on ShardOf and
+// the balancer counts, per epoch of routed commands, how many went to each
+// shard and which accounts dominate it. A shard that got well over its fair
+// share because of one hot account (a corporate card, a card testing
+// attack) is drained for the next epoch: every other account routed to it
+// is moved, as it is touched, to the least loaded shard, so the hot account
+// ends up with a core to itself instead of capping the whole process.
+// Moving the hot account would not help, so it stays. Only the routing
+// thread may use a LoadBalancer.
+class LoadBalancer {
+public:
+  static const std::uint64_t kDefaultEpoch = 16384;
+  // Moves allowed per epoch, so a drain spreads over several epochs instead
+  // of stalling the routing thread.
+  static const std::size_t kMaxMovesPerEpoch = 64;
+
+  explicit LoadBalancer(std::size_t shard_count,
+                        std::uint64_t epoch = kDefaultEpoch)
+      : shard_count_(shard_count), epoch_(epoch), routed_(0),
+        moves_left_(kMaxMovesPerEpoch), moves_(0), counts_(shard_count, 0),
+        hitters_(shard_count), draining_(shard_count, false),
+        hot_(shard_count, 0) {
+    assert(shard_count > 0 && epoch > 0);
+  }
+
+  // Shard that owns id right now.
+  std::size_t ShardFor(std::uint64_t id) const {
+    if (!moved_.empty()) {
+      auto it = moved_.find(id);
+      if (it != moved_.end())
+        return it->second;
+    }
+    return ShardOf(id, shard_count_);
+  }
+
+  // Returns the shard the next command for id must go to and stores the
+  // shard that owns id now in owner. When they differ the caller has to
+  // move the account's state from owner to the returned shard before
+  // handing it the command.
+  std::size_t Route(std::uint64_t id, std::size_t &owner) {
+    owner = ShardFor(id);
+    std::size_t shard = owner;
+    if (draining_[owner] && id != hot_[owner] && moves_left_ > 0) {
+      shard = LeastLoaded();
+      if (shard != owner) {
+        if (shard == ShardOf(id, shard_count_))
+          moved_.erase(id);
+        else
+          moved_[id] = (std::uint32_t)shard;
+        --moves_left_;
+        ++moves_;
+      }
+    }
+    ++counts_[shard];
+    hitters_[shard].Add(id);
+    if (++routed_ == epoch_)
+      EndEpoch();
+    return shard;
+  }
+
+  // Accounts moved so far.
+  std::uint64_t moves() const { return moves_; }
+
+  bool draining(std::size_t shard) const { return draining_[shard]; }
+
+private:
+  // Shard with the fewest commands this epoch among those not draining, or
+  // a draining one if every shard is.
+  std::size_t LeastLoaded() const {
+    std::size_t best = shard_count_;
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+      if (draining_[i])
+        continue;
+      if (best == shard_count_ || counts_[i] < counts_[best])
+        best = i;
+    }
+    return best == shard_count_ ? 0 : best;
+  }
+
+  // A shard drains when it got over 5/4 of a fair share and a single
+  // account alone made up at least half a fair share.
+  void EndEpoch() {
+    const std::uint64_t fair = epoch_ / shard_count_;
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+      std::uint64_t id = 0;
+      std::uint64_t count = 0;
+      draining_[i] = shard_count_ > 1 && counts_[i] * 4 > fair * 5 &&
+                     hitters_[i].Top(id, count) && count * 2 >= fair;
+      if (draining_[i])
+        hot_[i] = id;
+      counts_[i] = 0;
+      hitters_[i].Clear();
+    }
+    routed_ = 0;
+    moves_left_ = kMaxMovesPerEpoch;
+  }
+
+  const std::size_t shard_count_;
+  const std::uint64_t epoch_;
+  std::uint64_t routed_;
+  std::size_t moves_left_;
+  std::uint64_t moves_;
+  // Accounts living somewhere other than ShardOf.
+  std::unordered_map<std::uint64_t, std::uint32_t> moved_;
+  // Per shard, for the current epoch.
+  std::vector<std::uint64_t> counts_;
+  std::vector<HeavyHitters<4>> hitters_;
+  // Per shard, decided at the end of the last epoch.
+  std::vector<bool> draining_;
+  std::vector<std::uint64_t> hot_;
+};
+
+#endif
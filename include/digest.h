@@ -0,0 +1,75 @@
+#ifndef digest_h
+#define digest_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "engine.h"
+#include "globals.h"
+#include "merchants.h"
+#include "window.h"
+
+// A state digest is a 64-bit fingerprint of every account, used to check
+// that two ways of rebuilding the state (a snapshot, a replay of the log on
+// any number of threads) agree. It only depends on the accounts themselves:
+// accounts are summed, so neither their order nor the engine they live in
+// matters, and merchants count by the hash of their name rather than by
+// the id this process happened to give them. It covers every group of the
+// similar transactions map that has not expired, the whole state a later
+// transaction can be checked against, so a snapshot and a replay that would
+// give different verdicts never share a digest.
+
+// Folds value into h.
+std::uint64_t MixDigest(std::uint64_t h, std::uint64_t value) {
+  h ^= value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+template <std::size_t N>
+std::uint64_t MixTimes(std::uint64_t h, const TimeWindow<N> &window) {
+  h = MixDigest(h, window.size());
+  for (std::size_t i = window.size(); i >= 1; --i)
+    h = MixDigest(h, (std::uint64_t)window.Back(i));
+  return h;
+}
+
+// Digest of one account. merchant_hashes holds the name hash of every
+// merchant id the account refers to (see MerchantTable::Hashes).
+std::uint64_t AccountDigest(std::uint64_t id, const User &user,
+                            const std::vector<std::uint64_t> &merchant_hashes) {
+  std::uint64_t h = MixDigest(0, id);
+  h = MixDigest(h, (std::uint64_t)user.account.available_limit);
+  h = MixDigest(h, user.account.accepted);
+  h = MixDigest(h, user.account.active_card ? 1 : 0);
+  h = MixTimes(h, user.sequentialTransactions);
+  // Entries come out of the map in slot order, so they are summed too.
+  std::uint64_t groups = 0;
+  user.specificTransactions.ForEach(
+      [&](const TransactionKey &key,
+          const TimeWindow<kMaxRepetition> &times) {
+        std::uint64_t group = MixDigest(1, merchant_hashes[key.merchant]);
+        group = MixDigest(group, (std::uint64_t)key.amount);
+        groups += MixTimes(group, times);
+      });
+  return MixDigest(h, groups);
+}
+
+// Digest of every account of engine. Only for an engine whose thread is the
+// one calling, or that is parked. The digests of engines that split the
+// accounts between them add up to the digest of all of them.
+std::uint64_t StateDigest(const Engine &engine) {
+  std::vector<std::uint64_t> merchant_hashes;
+  Merchants().Hashes(merchant_hashes);
+  std::uint64_t digest = 0;
+  engine.ForEachAccount([&](std::uint64_t id, const User &user) {
+    digest += AccountDigest(id, user, merchant_hashes);
+  });
+  return digest;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef engine_h
+#define engine_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "accounts.h"
+#include "globals.h"
+#include "parser.h"
+#include "utils.h"
+#include "wal.h"
+#include "writer.h"
+
+// A decoded line ready to be evaluated. Unlike Message it holds no strings
+// (the merchant is interned and the time already parsed), so it is cheap to
+// copy into a queue for another thread.
+struct Command {
+  MessageType type = kUnknownMessage;
+  AccountMessage account;
+  Transaction transaction;
+
+  // Account the command belongs to.
+  std::uint64_t account_id() const {
+    return type == kAccountMessage ? account.id : transaction.account;
+  }
+};
+
+// Decodes one line into command, using message as scratch space. Returns
+// false for lines that get no response: invalid JSON, unknown shapes and
+// transactions with a malformed time.
+bool DecodeCommand(const char *data, std::size_t size, Message &message,
+                   Command &command) {
+  if (!ParseMessage(data, size, message))
+    return false;
+  command.type = message.type;
+  if (message.type == kAccountMessage) {
+    command.account = message.account;
+    return true;
+  }
+  return ToTransaction(message.transaction, command.transaction);
+}
+
+// Authorizes commands against the accounts it owns, one at a time and in the
+// order given. Every change it makes to an account (a creation, an accepted
+// transaction) is recorded in log, if given, before Handle returns.
+class Engine {
+public:
+  explicit Engine(WriteAheadLog *log = nullptr) : log_(log) {}
+
+  // Number of accounts created so far.
+  std::size_t size() const { return accounts_.size(); }
+
+  // Applies command and describes its outcome in response.
+  void Handle(const Command &command, Response &response) {
+    if (command.type == kAccountMessage)
+      HandleAccountCreation(command.account, response);
+    else
+      HandleTransactionCreation(command.transaction, response);
+  }
+
+  // Same as calling Handle on commands[0, count) in order, with the outcomes
+  // stored in responses. With many accounts every command would otherwise
+  // start with cache misses on the account index, the record and its
+  // history buckets, one after the other. Here the index slot is requested
+  // 2 * kPrefetchDistance commands ahead and the record and buckets
+  // kPrefetchDistance ahead (once the slot has likely arrived), so those
+  // misses overlap with evaluating the commands in between.
+  void HandleBatch(const Command *commands, std::size_t count,
+                   Response *responses) {
+    for (std::size_t i = 0; i < count && i < 2 * kPrefetchDistance; ++i)
+      accounts_.Prefetch(commands[i].account_id());
+    for (std::size_t i = 0; i < count && i < kPrefetchDistance; ++i)
+      PrefetchAccount(commands[i]);
+    for (std::size_t i = 0; i < count; ++i) {
+      if (i + 2 * kPrefetchDistance < count)
+        accounts_.Prefetch(commands[i + 2 * kPrefetchDistance].account_id());
+      if (i + kPrefetchDistance < count)
+        PrefetchAccount(commands[i + kPrefetchDistance]);
+      Handle(commands[i], responses[i]);
+    }
+  }
+
+  // Takes account id out of this engine so another one can adopt it, state
+  // and windows included. Leaves user empty if the account does not exist.
+  void Export(std::uint64_t id, std::unique_ptr<User> &user) {
+    User *found = accounts_.Find(id);
+    if (found == nullptr) {
+      user.reset();
+      return;
+    }
+    user.reset(new User(std::move(*found)));
+    accounts_.Remove(id);
+  }
+
+  // Adopts an account exported by another engine or read from a snapshot.
+  void Import(std::uint64_t id, const User &user) {
+    accounts_.Insert(id, user);
+  }
+
+  // Redoes a change read back from the log: creates the account or charges
+  // the transaction without checking any rule, since both were accepted
+  // when they were logged. Nothing is logged again. Returns false, changing
+  // nothing, if the change could not have been logged: the account already
+  // exists, or the transaction's account does not.
+  bool Replay(const Command &command) {
+    if (command.type == kAccountMessage) {
+      return accounts_.Insert(command.account.id,
+                              User(command.account.active_card,
+                                   command.account.available_limit)) !=
+             nullptr;
+    }
+    User *user = accounts_.Find(command.transaction.account);
+    if (user == nullptr)
+      return false;
+    ApplyTransaction(*user, command.transaction);
+    return true;
+  }
+
+  // Calls f(id, user) for every account, in no particular order.
+  template <typename F> void ForEachAccount(F f) const { accounts_.ForEach(f); }
+
+private:
+  // Commands between issuing a prefetch and using what it loads.
+  static const std::size_t kPrefetchDistance = 4;
+
+  // Starts loading what a transaction will touch: its account's record and
+  // the bucket of its merchant/amount group. Commands still ahead in the
+  // batch may create the account or change its windows; this is only a
+  // hint, so a stale or missing answer just means no prefetch.
+  void PrefetchAccount(const Command &command) {
+    if (command.type != kTransactionMessage)
+      return;
+    const User *user = accounts_.Find(command.transaction.account);
+    if (user == nullptr)
+      return;
+    __builtin_prefetch(user);
+    __builtin_prefetch(&user->specificTransactions);
+    user->specificTransactions.Prefetch(KeyOf(command.transaction));
+  }
+
+  void HandleAccountCreation(const AccountMessage &account,
+                             Response &response) {
+    Violations violations = kNoViolations;
+
+    // Verify if account is already active.
+    if (accounts_.Insert(account.id,
+                         User(account.active_card, account.available_limit)) ==
+        nullptr)
+      violations |= ViolationBit(kAccountAlreadyInitialized);
+    else if (log_ != nullptr)
+      log_->LogAccountCreated(account);
+
+    response.has_account = true;
+    response.account_id = account.id;
+    response.active_card = account.active_card;
+    response.available_limit = account.available_limit;
+    response.violations = violations;
+  }
+
+  void HandleTransactionCreation(const Transaction &incoming_transaction,
+                                 Response &response) {
+    User *current_user = accounts_.Find(incoming_transaction.account);
+
+    // If no registered user.
+    if (current_user == nullptr) {
+      response.has_account = false;
+      response.violations = ViolationBit(kAccountNotInitialized);
+      return;
+    }
+
+    // Accept transaction.
+    const Violations violations =
+        CheckTransaction(*current_user, incoming_transaction);
+    if (violations == kNoViolations) {
+      ApplyTransaction(*current_user, incoming_transaction);
+      if (log_ != nullptr)
+        log_->LogTransactionApplied(incoming_transaction);
+    }
+
+    // Render account details as output.
+    response.has_account = true;
+    response.account_id = incoming_transaction.account;
+    response.active_card = current_user->account.active_card;
+    response.available_limit = current_user->account.available_limit;
+    response.violations = violations;
+  }
+
+  AccountTable accounts_;
+  WriteAheadLog *log_;
+};
+
+#endif
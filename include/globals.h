@@ -1,10 +1,11 @@
 #ifndef globals_h
 #define globals_h
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
-#include <unordered_map>
 
-#include "json.hpp"
+#include "window.h"
 
 // Basic errors specified in the documentation.
 enum GenericErrors {
@@ -18,42 +19,121 @@ enum GenericErrors {
 };
 
 // Basic error messages corresponding to GenericErrors.
-char const *kOkMessage = "Ok";
-char const *kAccountAlreadyInitializedMessage = "account-already-initialized";
-char const *kAccountNotInitializedMessage = "account-not-initialized";
-char const *kCardNotActiveMessage = "card-not-active";
-char const *kInsufficientLimitMessage = "insufficient-limit";
-char const *kHighFrequencySmallIntervalMessage =
+constexpr char const *kOkMessage = "Ok";
+constexpr char const *kAccountAlreadyInitializedMessage =
+    "account-already-initialized";
+constexpr char const *kAccountNotInitializedMessage = "account-not-initialized";
+constexpr char const *kCardNotActiveMessage = "card-not-active";
+constexpr char const *kInsufficientLimitMessage = "insufficient-limit";
+constexpr char const *kHighFrequencySmallIntervalMessage =
     "high-frequency-small-interval";
-char const *kDoubledTransactionMessage = "doubled-transaction";
-char const *kDefaultViolationMessage = "default-violation";
+constexpr char const *kDoubledTransactionMessage = "doubled-transaction";
+constexpr char const *kDefaultViolationMessage = "default-violation";
 
-// Basic structure for user; Contains 2 main datastructures.
-// 1. sequentialTransactions
-//    A vector of json-transitions in a sequence as a vector.
-// 2. specificTransactions
-//    A hashmap where the (k, v) is (txnhash, vector of 'similar' transactions).
-struct User {
-  // Class constructor to create accounts.
-  User(nlohmann::json acc) : account(acc){};
-  // JSON account obj with 2 fields in general, "active-card" and
-  // "available-limit".
-  nlohmann::json account;
-  // Vector of transaction jsons which are sequential.
-  std::vector<nlohmann::json> sequentialTransactions;
-  // Hashmap of transactions in sequential order.
-  // Hashes are calculated using std::hash and concatenation of the json in
-  // string form except for "time" field.
-  std::unordered_map<std::string, std::vector<nlohmann::json>>
-      specificTransactions;
+// Violation messages indexed by GenericErrors. Only needed when a result is
+// rendered; checks deal in Violations.
+constexpr char const *kViolationNames[] = {
+    kOkMessage,
+    kAccountAlreadyInitializedMessage,
+    kAccountNotInitializedMessage,
+    kCardNotActiveMessage,
+    kInsufficientLimitMessage,
+    kHighFrequencySmallIntervalMessage,
+    kDoubledTransactionMessage,
 };
 
-// Constants for doubled-transaction condition.
-const unsigned long long kRepeatedWindow = 120;
+constexpr std::size_t kViolationCount =
+    sizeof(kViolationNames) / sizeof(kViolationNames[0]);
+
+// Outcome of a check: bit (1 << error) is set for every GenericErrors raised.
+// Bits are ordered like GenericErrors, which is also the output order.
+typedef unsigned int Violations;
+
+const Violations kNoViolations = 0;
+
+constexpr Violations ViolationBit(GenericErrors error) { return 1u << error; }
+
+// Constants for doubled-transaction condition. Windows are in milliseconds.
+const unsigned long long kRepeatedWindow = 120 * 1000;
 const unsigned long long kMaxRepetition = 1;
 
 // Constants for high-frequency-small-interval condition.
-const unsigned long long kFrequencyWindow = 120;
+const unsigned long long kFrequencyWindow = 120 * 1000;
 const unsigned long long kMaxFrequency = 3;
 
+// Compact record of a transaction as used by the business rules. Time is in
+// unix milliseconds and merchant is an id handed out by InternMerchant.
+// account is the id of the account it is charged to.
+struct Transaction {
+  long long time;
+  long long amount;
+  std::uint32_t merchant;
+  std::uint64_t account;
+};
+
+// Fields that make two transactions 'similar'; everything except time.
+struct TransactionKey {
+  std::uint32_t merchant;
+  long long amount;
+
+  bool operator==(const TransactionKey &other) const {
+    return merchant == other.merchant && amount == other.amount;
+  }
+};
+
+// 64-bit hash for TransactionKey (murmur3 finalizer over both fields).
+struct TransactionKeyHash {
+  std::uint64_t operator()(const TransactionKey &key) const {
+    std::uint64_t h =
+        (std::uint64_t)key.amount * 0x9e3779b97f4a7c15ULL + key.merchant;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+// Times of similar transactions grouped by their TransactionKey, keeping the
+// last N of each group. Groups expire two windows after their last time.
+template <std::size_t N>
+using WindowsByKey = WindowMap<TransactionKey, TransactionKeyHash, N>;
+
+typedef WindowsByKey<kMaxRepetition> TransactionsByKey;
+
+// State of an account as the rules see it, kept as plain fields so checks
+// and updates never go through string keyed lookups. Rendered to JSON only
+// when a response is written.
+struct AccountState {
+  long long available_limit = 0;
+  // Transactions accepted and charged so far.
+  std::uint64_t accepted = 0;
+  bool active_card = false;
+};
+
+// Basic structure for user; Contains 2 main datastructures, both only keeping
+// as many timestamps as the business rules look back at.
+// 1. sequentialTransactions
+//    A ring with the times of the last kMaxFrequency transactions.
+// 2. specificTransactions
+//    A hashmap where the (k, v) is (txnkey, ring with the times of the last
+//    kMaxRepetition 'similar' transactions). Only keys accepted within the
+//    last two kRepeatedWindow are kept.
+struct User {
+  // Class constructor to create accounts.
+  User(bool active_card, long long available_limit)
+      : specificTransactions(kRepeatedWindow) {
+    account.active_card = active_card;
+    account.available_limit = available_limit;
+  }
+  // Card status, limit and counters of the account.
+  AccountState account;
+  // Times of the last accepted transactions in sequential order.
+  TimeWindow<kMaxFrequency> sequentialTransactions;
+  // Hashmap of the times of accepted transactions in sequential order, keyed
+  // by every field except time.
+  TransactionsByKey specificTransactions;
+};
+
 #endif
\ No newline at end of file
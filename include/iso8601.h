@@ -0,0 +1,203 @@
+#ifndef iso8601_h
+#define iso8601_h
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Fixed-format ISO8601 parsing for "YYYY-MM-DDTHH:MM:SS[.fff](Z|+HH:MM)".
+// Digits are validated and converted without sscanf/timegm and the result is
+// computed arithmetically, so it is independent of the process timezone and
+// never reads past the given size.
+
+// Calendar fields of the fixed "YYYY-MM-DDTHH:MM" prefix.
+struct DateTimePrefix {
+  int year;
+  int month;
+  int day;
+  int hour;
+  int minute;
+};
+
+// Length of the "YYYY-MM-DDTHH:MM" prefix handled by ParseDateTimePrefix.
+const std::size_t kDateTimePrefixSize = 16;
+
+// Days before the first of each month in a non-leap year.
+const int kDaysBeforeMonth[12] = {0,   31,  59,  90,  120, 151,
+                                  181, 212, 243, 273, 304, 334};
+
+bool IsLeapYear(int year) {
+  return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+int DaysInMonth(int year, int month) {
+  static const int kDays[12] = {31, 28, 31, 30, 31, 30,
+                                31, 31, 30, 31, 30, 31};
+  return month == 2 && IsLeapYear(year) ? 29 : kDays[month - 1];
+}
+
+// Days since 1970-01-01 of a valid proleptic Gregorian date with year >= 1.
+long long DaysFromCivil(int year, int month, int day) {
+  const long long y = year - 1;
+  const long long leap_days_before = y / 4 - y / 100 + y / 400;
+  // 719162 is the number of days from 0001-01-01 to 1970-01-01.
+  return y * 365 + leap_days_before - 719162 + kDaysBeforeMonth[month - 1] +
+         (month > 2 && IsLeapYear(year) ? 1 : 0) + day - 1;
+}
+
+// Reads the two digits at p, returning -1 if either is not a digit.
+int TwoDigits(const char *p) {
+  const unsigned int hi = (unsigned char)p[0] - '0';
+  const unsigned int lo = (unsigned char)p[1] - '0';
+  return hi <= 9 && lo <= 9 ? (int)(hi * 10 + lo) : -1;
+}
+
+// Scalar version of ParseDateTimePrefix. p must have kDateTimePrefixSize
+// readable bytes.
+bool ParseDateTimePrefixScalar(const char *p, DateTimePrefix &prefix) {
+  if (p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != 't') ||
+      p[13] != ':')
+    return false;
+  const int century = TwoDigits(p);
+  const int year = TwoDigits(p + 2);
+  prefix.month = TwoDigits(p + 5);
+  prefix.day = TwoDigits(p + 8);
+  prefix.hour = TwoDigits(p + 11);
+  prefix.minute = TwoDigits(p + 14);
+  if (century < 0 || year < 0 || prefix.month < 0 || prefix.day < 0 ||
+      prefix.hour < 0 || prefix.minute < 0)
+    return false;
+  prefix.year = century * 100 + year;
+  return true;
+}
+
+#if defined(__SSE2__)
+// SSE2 version of ParseDateTimePrefix: validates all 16 bytes with two
+// compares and converts the digit pairs in 16-bit lanes (tens * 10 + ones).
+// p must have kDateTimePrefixSize readable bytes.
+bool ParseDateTimePrefixSse2(const char *p, DateTimePrefix &prefix) {
+  const __m128i input = _mm_loadu_si128((const __m128i *)p);
+
+  // Fold 'T' to 't' (only byte 10 gets the 0x20 bit) and compare the
+  // separators against the expected template.
+  const __m128i folded = _mm_or_si128(
+      input, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x20, 0, 0, 0, 0, 0));
+  const __m128i separators = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0,
+                                           't', 0, 0, ':', 0, 0);
+  const int separator_bits =
+      _mm_movemask_epi8(_mm_cmpeq_epi8(folded, separators));
+
+  // A byte is a digit when (byte - '0') <= 9 as unsigned.
+  const __m128i digits = _mm_sub_epi8(input, _mm_set1_epi8('0'));
+  const __m128i nine = _mm_set1_epi8(9);
+  const int digit_bits = _mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_max_epu8(digits, nine), nine));
+
+  const int kSeparatorMask = (1 << 4) | (1 << 7) | (1 << 10) | (1 << 13);
+  const int kDigitMask = 0xffff & ~kSeparatorMask;
+  if ((separator_bits & kSeparatorMask) != kSeparatorMask ||
+      (digit_bits & kDigitMask) != kDigitMask)
+    return false;
+
+  // Pairs starting at even offsets (YY, YY, DD, mm) and, after a one byte
+  // shift, at odd offsets (MM, HH).
+  const __m128i low_byte = _mm_set1_epi16(0x00ff);
+  const __m128i ten = _mm_set1_epi16(10);
+  const __m128i even = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_and_si128(digits, low_byte), ten),
+      _mm_srli_epi16(digits, 8));
+  const __m128i shifted = _mm_srli_si128(digits, 1);
+  const __m128i odd = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_and_si128(shifted, low_byte), ten),
+      _mm_srli_epi16(shifted, 8));
+
+  prefix.year = _mm_extract_epi16(even, 0) * 100 + _mm_extract_epi16(even, 1);
+  prefix.month = _mm_extract_epi16(odd, 2);
+  prefix.day = _mm_extract_epi16(even, 4);
+  prefix.hour = _mm_extract_epi16(odd, 5);
+  prefix.minute = _mm_extract_epi16(even, 7);
+  return true;
+}
+#endif
+
+// Parses and validates the digits and separators of "YYYY-MM-DDTHH:MM".
+bool ParseDateTimePrefix(const char *p, DateTimePrefix &prefix) {
+#if defined(__SSE2__)
+  return ParseDateTimePrefixSse2(p, prefix);
+#else
+  return ParseDateTimePrefixScalar(p, prefix);
+#endif
+}
+
+// Parses "YYYY-MM-DDTHH:MM:SS" followed by an optional fraction of a second
+// and either "Z"/"z" or a "+HH:MM"/"-HH:MM" offset, e.g.
+// "2019-02-13T10:00:00.000Z" or "1997-08-14T01:24:21+00:00". Stores the unix
+// time in milliseconds in epoch_ms; digits past milliseconds are truncated.
+// Returns false without touching epoch_ms if data is not in this format or
+// holds an out of range field.
+bool ParseISO8601(const char *data, std::size_t size, long long &epoch_ms) {
+  // Shortest valid input is "YYYY-MM-DDTHH:MM:SSZ".
+  if (size < kDateTimePrefixSize + 4)
+    return false;
+  DateTimePrefix prefix;
+  if (!ParseDateTimePrefix(data, prefix))
+    return false;
+  if (data[16] != ':')
+    return false;
+  const int second = TwoDigits(data + 17);
+  if (second < 0)
+    return false;
+
+  // Allow a leap second; like timegm it rolls over into the next minute.
+  if (prefix.year < 1 || prefix.month < 1 || prefix.month > 12 ||
+      prefix.day < 1 || prefix.day > DaysInMonth(prefix.year, prefix.month) ||
+      prefix.hour > 23 || prefix.minute > 59 || second > 60)
+    return false;
+
+  const char *p = data + 19;
+  const char *end = data + size;
+  int millis = 0;
+  if (*p == '.') {
+    ++p;
+    int digits = 0;
+    for (; p < end && (unsigned int)(*p - '0') <= 9; ++p, ++digits) {
+      if (digits < 3)
+        millis = millis * 10 + (*p - '0');
+    }
+    if (digits == 0)
+      return false;
+    for (; digits < 3; ++digits)
+      millis *= 10;
+  }
+
+  long long offset_minutes = 0;
+  if (p < end && (*p == 'Z' || *p == 'z')) {
+    ++p;
+  } else if (end - p >= 6 && (*p == '+' || *p == '-') && p[3] == ':') {
+    const int offset_hour = TwoDigits(p + 1);
+    const int offset_minute = TwoDigits(p + 4);
+    if (offset_hour < 0 || offset_hour > 23 || offset_minute < 0 ||
+        offset_minute > 59)
+      return false;
+    offset_minutes = offset_hour * 60 + offset_minute;
+    if (*p == '-')
+      offset_minutes = -offset_minutes;
+    p += 6;
+  } else {
+    return false;
+  }
+  if (p != end)
+    return false;
+
+  const long long days =
+      DaysFromCivil(prefix.year, prefix.month, prefix.day);
+  const long long seconds = days * 86400 + prefix.hour * 3600 +
+                            prefix.minute * 60 + second - offset_minutes * 60;
+  epoch_ms = seconds * 1000 + millis;
+  return true;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef merchants_h
+#define merchants_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "arena.h"
+
+// 64-bit FNV-1a of a merchant name.
+std::uint64_t HashMerchant(const char *data, std::size_t size) {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (std::size_t i = 0; i < size; ++i) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Process wide dictionary of merchant names, handing out dense 32-bit ids
+// from 0 in order of first appearance. There are a few hundred thousand
+// merchants against billions of transactions, so almost every call finds a
+// name that is already known; Find and the hit path of Intern take no lock
+// and only read shared memory. The table is open addressing over pointers
+// to immutable entries. Adding a name takes a mutex, publishes the entry
+// with a single store and, past half full, publishes a copy of the table
+// twice the size. Replaced tables are kept, since a reader may still be
+// probing them, which at most doubles the size of the index.
+class MerchantTable {
+public:
+  static const std::size_t kInitialCapacity = 1024;
+
+  MerchantTable() : count_(0) {
+    tables_.emplace_back(new Table(kInitialCapacity));
+    table_.store(tables_.back().get(), std::memory_order_relaxed);
+  }
+
+  MerchantTable(const MerchantTable &) = delete;
+  MerchantTable &operator=(const MerchantTable &) = delete;
+
+  // Stores the id of name [data, data + size) and returns true, or returns
+  // false if it was never interned.
+  bool Find(const char *data, std::size_t size, std::uint32_t &id) const {
+    const Entry *entry =
+        Lookup(*table_.load(std::memory_order_acquire), data, size,
+               HashMerchant(data, size));
+    if (entry == nullptr)
+      return false;
+    id = entry->id;
+    return true;
+  }
+
+  // Returns the id of name [data, data + size), adding it if it is new.
+  std::uint32_t Intern(const char *data, std::size_t size) {
+    const std::uint64_t hash = HashMerchant(data, size);
+    const Entry *entry =
+        Lookup(*table_.load(std::memory_order_acquire), data, size, hash);
+    if (entry != nullptr)
+      return entry->id;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Table &table = *table_.load(std::memory_order_relaxed);
+    entry = Lookup(table, data, size, hash);
+    if (entry != nullptr)
+      return entry->id;
+    Entry *added = (Entry *)names_.Allocate(sizeof(Entry) + size,
+                                            alignof(Entry));
+    added->hash = hash;
+    added->id = (std::uint32_t)names_by_id_.size();
+    added->size = (std::uint32_t)size;
+    if (size > 0)
+      std::memcpy(added->name(), data, size);
+    names_by_id_.push_back(added);
+    Place(table, added);
+    count_.store(names_by_id_.size(), std::memory_order_release);
+    if (names_by_id_.size() * 2 > table.slots.size())
+      Grow(table);
+    return added->id;
+  }
+
+  // Number of names interned so far.
+  std::size_t size() const { return count_.load(std::memory_order_acquire); }
+
+  // Points data and size at the name with id, which must be below size().
+  // Takes the lock; meant for writing out the dictionary, not the hot path.
+  void Name(std::uint32_t id, const char *&data, std::size_t &size) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Entry *entry = names_by_id_[id];
+    data = entry->name();
+    size = entry->size;
+  }
+
+  // Stores HashMerchant of every name interned so far into hashes, indexed
+  // by id. Takes the lock once for all of them.
+  void Hashes(std::vector<std::uint64_t> &hashes) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hashes.resize(names_by_id_.size());
+    for (std::size_t id = 0; id < names_by_id_.size(); ++id)
+      hashes[id] = names_by_id_[id]->hash;
+  }
+
+  // Holds off every insert until the returned lock is released. For fork():
+  // held across it, no name is half added in the child, whose copy of the
+  // lock is released along with the parent's.
+  std::unique_lock<std::mutex> Lock() const {
+    return std::unique_lock<std::mutex>(mutex_);
+  }
+
+private:
+  // An interned name, followed in memory by its bytes. Never changes once
+  // published.
+  struct Entry {
+    std::uint64_t hash;
+    std::uint32_t id;
+    std::uint32_t size;
+
+    char *name() { return (char *)(this + 1); }
+    const char *name() const { return (const char *)(this + 1); }
+  };
+
+  struct Table {
+    explicit Table(std::size_t capacity) : slots(capacity) {
+      for (auto &slot : slots)
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+
+    std::vector<std::atomic<const Entry *>> slots;
+  };
+
+  static const Entry *Lookup(const Table &table, const char *data,
+                             std::size_t size, std::uint64_t hash) {
+    const std::size_t mask = table.slots.size() - 1;
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Entry *entry = table.slots[i].load(std::memory_order_acquire);
+      if (entry == nullptr)
+        return nullptr;
+      if (entry->hash == hash && entry->size == size &&
+          std::memcmp(entry->name(), data, size) == 0)
+        return entry;
+    }
+  }
+
+  // Publishes entry in the first free slot of its probe sequence. Only
+  // called with the lock held, on a table with free slots.
+  static void Place(Table &table, const Entry *entry) {
+    const std::size_t mask = table.slots.size() - 1;
+    std::size_t i = entry->hash & mask;
+    while (table.slots[i].load(std::memory_order_relaxed) != nullptr)
+      i = (i + 1) & mask;
+    table.slots[i].store(entry, std::memory_order_release);
+  }
+
+  void Grow(const Table &table) {
+    tables_.emplace_back(new Table(table.slots.size() * 2));
+    Table &bigger = *tables_.back();
+    for (const Entry *entry : names_by_id_)
+      Place(bigger, entry);
+    table_.store(&bigger, std::memory_order_release);
+  }
+
+  // Table readers probe.
+  std::atomic<Table *> table_;
+  std::atomic<std::size_t> count_;
+  // Everything below is guarded by mutex_.
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  Arena names_;
+  std::vector<const Entry *> names_by_id_;
+};
+
+// The table every thread interns merchants into.
+MerchantTable &Merchants() {
+  static MerchantTable merchants;
+  return merchants;
+}
+
+#endif
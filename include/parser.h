@@ -0,0 +1,397 @@
+#ifndef parser_h
+#define parser_h
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "json.hpp"
+
+#include "arena.h"
+
+// Kind of message decoded from a single input line.
+enum MessageType {
+  kUnknownMessage = 0,
+  kAccountMessage,
+  kTransactionMessage,
+};
+
+// Typed payload of {"account": {"account-id": ..., "active-card": ...,
+// "available-limit": ...}}. A missing "account-id" means account 0, the
+// single account of inputs that predate ids.
+struct AccountMessage {
+  std::uint64_t id = 0;
+  bool active_card = false;
+  long long available_limit = 0;
+};
+
+// Contents of a decoded string value. The bytes are either in the line
+// itself or in the arena of the Message holding the view.
+struct TextView {
+  const char *data = "";
+  std::size_t size = 0;
+};
+
+// Typed payload of {"transaction": {"account-id": ..., "merchant": ...,
+// "amount": ..., "time": ...}}. A missing "account-id" means account 0.
+struct TransactionMessage {
+  std::uint64_t account_id = 0;
+  TextView merchant;
+  long long amount = 0;
+  TextView time;
+};
+
+// Result of decoding one line. Only the payload matching type is meaningful.
+// Strings point into the line or into arena, so they are only valid while
+// the line is and until the message is reset for the next one.
+struct Message {
+  MessageType type = kUnknownMessage;
+  AccountMessage account;
+  TransactionMessage transaction;
+  Arena arena;
+};
+
+// SAX consumer that decodes the two known message shapes straight into a
+// Message without building json nodes. Unknown keys and nested values are
+// skipped; if a line carries both "account" and "transaction" the account
+// wins, same as the previous DOM based dispatch.
+class MessageSax : public nlohmann::json_sax<nlohmann::json> {
+public:
+  explicit MessageSax(Message &message) : message_(message) {}
+
+  bool null() override { return true; }
+
+  bool boolean(bool val) override {
+    if (field_ == kActiveCard && InSection())
+      message_.account.active_card = val;
+    return true;
+  }
+
+  bool number_integer(number_integer_t val) override {
+    return Number((long long)val, (std::uint64_t)val);
+  }
+
+  bool number_unsigned(number_unsigned_t val) override {
+    return Number((long long)val, (std::uint64_t)val);
+  }
+
+  // A number written with a fraction or an exponent is taken if it is a
+  // whole number its field can hold. Anything else makes the message
+  // malformed: converting it would be undefined.
+  bool number_float(number_float_t val, const string_t &) override {
+    if (!InSection())
+      return true;
+    if (val != std::trunc(val))
+      return field_ != kAccountId && field_ != kAvailableLimit &&
+             field_ != kAmount;
+    if (field_ == kAccountId)
+      return val >= 0 && val < 18446744073709551616.0 &&
+             Number(0, (std::uint64_t)val);
+    if (field_ == kAvailableLimit || field_ == kAmount)
+      return val >= -9223372036854775808.0 && val < 9223372036854775808.0 &&
+             Number((long long)val, 0);
+    return true;
+  }
+
+  bool string(string_t &val) override {
+    if (!InSection())
+      return true;
+    if (field_ == kMerchant)
+      message_.transaction.merchant = Keep(val);
+    else if (field_ == kTime)
+      message_.transaction.time = Keep(val);
+    return true;
+  }
+
+  bool start_object(std::size_t) override {
+    ++depth_;
+    if (depth_ == 2 && section_ != kUnknownMessage &&
+        message_.type != kAccountMessage) {
+      message_.type = section_;
+      in_section_ = true;
+    }
+    return true;
+  }
+
+  bool key(string_t &val) override {
+    if (depth_ == 1) {
+      section_ = val == "account"       ? kAccountMessage
+                 : val == "transaction" ? kTransactionMessage
+                                        : kUnknownMessage;
+    } else if (depth_ == 2 && in_section_) {
+      field_ = FieldFromKey(val);
+    }
+    return true;
+  }
+
+  bool end_object() override {
+    if (depth_ == 2)
+      in_section_ = false;
+    field_ = kNoField;
+    --depth_;
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    ++depth_;
+    return true;
+  }
+
+  bool end_array() override {
+    --depth_;
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &) override {
+    return false;
+  }
+
+private:
+  // Fields of both schemas; only "account-id" is shared by the two.
+  enum Field {
+    kNoField = 0,
+    kAccountId,
+    kActiveCard,
+    kAvailableLimit,
+    kMerchant,
+    kAmount,
+    kTime,
+  };
+
+  Field FieldFromKey(const std::string &key) const {
+    if (key == "account-id")
+      return kAccountId;
+    if (message_.type == kAccountMessage) {
+      if (key == "active-card")
+        return kActiveCard;
+      if (key == "available-limit")
+        return kAvailableLimit;
+    } else {
+      if (key == "merchant")
+        return kMerchant;
+      if (key == "amount")
+        return kAmount;
+      if (key == "time")
+        return kTime;
+    }
+    return kNoField;
+  }
+
+  // Values only count when they sit directly inside the selected section.
+  bool InSection() const { return in_section_ && depth_ == 2; }
+
+  // Copies an unescaped string value out of the parser's buffer, which the
+  // next token overwrites, into the message's arena.
+  TextView Keep(const string_t &val) {
+    TextView view;
+    view.data = message_.arena.Copy(val.data(), val.size());
+    view.size = val.size();
+    return view;
+  }
+
+  // Amounts are signed; ids are taken as unsigned 64-bit values.
+  bool Number(long long val, std::uint64_t id) {
+    if (!InSection())
+      return true;
+    if (field_ == kAccountId && message_.type == kAccountMessage)
+      message_.account.id = id;
+    else if (field_ == kAccountId)
+      message_.transaction.account_id = id;
+    else if (field_ == kAvailableLimit)
+      message_.account.available_limit = val;
+    else if (field_ == kAmount)
+      message_.transaction.amount = val;
+    return true;
+  }
+
+  Message &message_;
+  int depth_ = 0;
+  MessageType section_ = kUnknownMessage;
+  bool in_section_ = false;
+  Field field_ = kNoField;
+};
+
+// Position of the fast path scanner in a line.
+struct ScanCursor {
+  const char *p;
+  const char *end;
+};
+
+void SkipWhitespace(ScanCursor &cursor) {
+  while (cursor.p < cursor.end && (*cursor.p == ' ' || *cursor.p == '\t' ||
+                                   *cursor.p == '\n' || *cursor.p == '\r'))
+    ++cursor.p;
+}
+
+// Consumes expected after optional whitespace.
+bool ScanChar(ScanCursor &cursor, char expected) {
+  SkipWhitespace(cursor);
+  if (cursor.p == cursor.end || *cursor.p != expected)
+    return false;
+  ++cursor.p;
+  return true;
+}
+
+// Consumes a string of printable ASCII without escapes and points text at
+// its contents in the line.
+bool ScanPlainString(ScanCursor &cursor, TextView &text) {
+  if (!ScanChar(cursor, '"'))
+    return false;
+  const char *begin = cursor.p;
+  for (; cursor.p < cursor.end; ++cursor.p) {
+    const unsigned char c = *cursor.p;
+    if (c == '"') {
+      text.data = begin;
+      text.size = cursor.p - begin;
+      ++cursor.p;
+      return true;
+    }
+    if (c == '\\' || c < 0x20 || c >= 0x80)
+      return false;
+  }
+  return false;
+}
+
+// Consumes an integer of at most 18 digits, so it fits either way it is read
+// as. value is what MessageSax::Number gets as its signed argument.
+bool ScanInteger(ScanCursor &cursor, long long &value) {
+  SkipWhitespace(cursor);
+  const bool negative = cursor.p < cursor.end && *cursor.p == '-';
+  if (negative)
+    ++cursor.p;
+  const char *digits = cursor.p;
+  unsigned long long magnitude = 0;
+  for (; cursor.p < cursor.end && (unsigned int)(*cursor.p - '0') <= 9;
+       ++cursor.p) {
+    magnitude = magnitude * 10 + (*cursor.p - '0');
+  }
+  const std::size_t count = cursor.p - digits;
+  // Leading zeros, fractions, exponents and huge values are left to the
+  // full parser.
+  if (count == 0 || count > 18 || (count > 1 && *digits == '0'))
+    return false;
+  if (cursor.p < cursor.end &&
+      (*cursor.p == '.' || *cursor.p == 'e' || *cursor.p == 'E'))
+    return false;
+  value = negative ? -(long long)magnitude : (long long)magnitude;
+  return true;
+}
+
+bool ScanBool(ScanCursor &cursor, bool &value) {
+  SkipWhitespace(cursor);
+  const std::size_t left = cursor.end - cursor.p;
+  if (left >= 4 && std::memcmp(cursor.p, "true", 4) == 0) {
+    value = true;
+    cursor.p += 4;
+    return true;
+  }
+  if (left >= 5 && std::memcmp(cursor.p, "false", 5) == 0) {
+    value = false;
+    cursor.p += 5;
+    return true;
+  }
+  return false;
+}
+
+template <std::size_t N>
+bool KeyIs(const TextView &key, const char (&expected)[N]) {
+  return key.size == N - 1 && std::memcmp(key.data, expected, N - 1) == 0;
+}
+
+// Consumes the value of field key inside the section of message.type.
+// Strings are left pointing into the line.
+bool ScanField(ScanCursor &cursor, const TextView &key, Message &message) {
+  long long number;
+  if (KeyIs(key, "account-id")) {
+    if (!ScanInteger(cursor, number))
+      return false;
+    if (message.type == kAccountMessage)
+      message.account.id = (std::uint64_t)number;
+    else
+      message.transaction.account_id = (std::uint64_t)number;
+    return true;
+  }
+  if (message.type == kAccountMessage) {
+    if (KeyIs(key, "active-card"))
+      return ScanBool(cursor, message.account.active_card);
+    if (KeyIs(key, "available-limit"))
+      return ScanInteger(cursor, message.account.available_limit);
+    return false;
+  }
+  if (KeyIs(key, "amount"))
+    return ScanInteger(cursor, message.transaction.amount);
+  if (KeyIs(key, "merchant"))
+    return ScanPlainString(cursor, message.transaction.merchant);
+  if (KeyIs(key, "time"))
+    return ScanPlainString(cursor, message.transaction.time);
+  return false;
+}
+
+// Fast path of ParseMessage for what producers actually send: one "account"
+// or "transaction" object holding only its known fields, with integers,
+// booleans and plain ASCII strings as values, in any order. Decodes it into
+// a reset message without copying or allocating anything: the strings are
+// left pointing into the line. Returns false, possibly with message half
+// filled, as soon as the line holds anything else (other keys, escapes,
+// non-ASCII text, floats, malformed JSON), leaving it to the SAX parser so
+// that no line is decoded differently than before.
+bool ScanMessage(const char *data, std::size_t size, Message &message) {
+  ScanCursor cursor = {data, data + size};
+  TextView key;
+  if (!ScanChar(cursor, '{') || !ScanPlainString(cursor, key) ||
+      !ScanChar(cursor, ':') || !ScanChar(cursor, '{'))
+    return false;
+  if (KeyIs(key, "account"))
+    message.type = kAccountMessage;
+  else if (KeyIs(key, "transaction"))
+    message.type = kTransactionMessage;
+  else
+    return false;
+
+  SkipWhitespace(cursor);
+  if (cursor.p < cursor.end && *cursor.p == '}') {
+    ++cursor.p;
+  } else {
+    do {
+      if (!ScanPlainString(cursor, key) || !ScanChar(cursor, ':') ||
+          !ScanField(cursor, key, message))
+        return false;
+    } while (ScanChar(cursor, ','));
+    if (!ScanChar(cursor, '}'))
+      return false;
+  }
+  if (!ScanChar(cursor, '}'))
+    return false;
+  SkipWhitespace(cursor);
+  return cursor.p == cursor.end;
+}
+
+// Sets message back to an empty line's result, taking back its arena.
+void ResetMessage(Message &message) {
+  message.type = kUnknownMessage;
+  message.account = AccountMessage();
+  message.transaction = TransactionMessage();
+  message.arena.Reset();
+}
+
+// Decodes a single line into message. Returns false if the line is not valid
+// JSON or matches neither schema. Common lines take the allocation free
+// ScanMessage path; everything else goes through MessageSax, which keeps its
+// strings in message's arena.
+bool ParseMessage(const char *data, std::size_t size, Message &message) {
+  ResetMessage(message);
+  if (ScanMessage(data, size, message))
+    return true;
+  ResetMessage(message);
+
+  MessageSax sax(message);
+  if (!nlohmann::json::sax_parse(nlohmann::detail::input_adapter(data, size),
+                                 &sax))
+    return false;
+  return message.type != kUnknownMessage;
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+#include "parser.h"
+#include "queue.h"
+#include "reader.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "wal.h"
+
+// Runs every stage of the binary on threads of its own:
+//
+//   reader -> parsers -> dispatcher -> shards -> writer
+//
+// The reader copies each input line into a slot of a fixed ring indexed by
+// line number. Parser threads decode the slots into Commands: each claims a
+// small batch of read lines at a time into its own WorkStealingDeque, and a
+// parser that runs dry steals single lines from the others before claiming
+// more, so one very long line only delays the line itself while the rest of
+// its batch moves to idle parsers. The dispatcher (the thread that
+// calls Run) walks the ring in line order, waits for each slot to be
+// decoded and submits it to a ShardedEngine, whose shards evaluate the
+// rules and whose writer thread renders the responses. Every hand-off is a
+// lock-free bounded ring, and the dispatcher frees a slot as soon as its
+// command is submitted, which is what holds the reader back when a later
+// stage falls behind.
+//
+// Reading, decoding, evaluation and output therefore overlap even when all
+// accounts live on one shard, and the output is the same as the single
+// threaded loop. Changes are recorded in log, if given, as the shards make
+// them.
+class Pipeline {
+public:
+  static const std::size_t kDefaultLineCapacity = 8192;
+  // Lines a parser claims at once; big enough to keep the shared claim
+  // counter cold, small enough to leave work for thieves.
+  static const std::size_t kParseBatch = 32;
+  // Commands submitted between checks whether a snapshot child is done.
+  static const std::uint64_t kSnapshotPollEvery = 4096;
+
+  Pipeline(std::size_t shard_count, std::size_t parser_count,
+           std::ostream &out, bool ordered = true,
+           std::size_t line_capacity = kDefaultLineCapacity,
+           WriteAheadLog *log = nullptr)
+      : engine_(shard_count, out, ordered,
+                ShardedEngine::kDefaultQueueCapacity,
+                ShardedEngine::kDefaultReorderCapacity, log),
+        slots_(RoundUpToPowerOfTwo(line_capacity)),
+        mask_(slots_.size() - 1), parser_count_(parser_count), read_(0),
+        claimed_(0), dispatched_(0), eof_(false), line_count_(0),
+        read_error_(0), snapshot_path_(nullptr), snapshot_every_(0),
+        fork_snapshots_(false) {
+    assert(parser_count > 0);
+    for (std::size_t i = 0; i < parser_count; ++i)
+      deques_.emplace_back(new WorkStealingDeque(kParseBatch));
+    for (auto &slot : slots_)
+      slot.decoded.store(0, std::memory_order_relaxed);
+  }
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  // The engine the pipeline feeds, e.g. to restore state into before Run.
+  ShardedEngine &engine() { return engine_; }
+
+  // Makes Run write a snapshot to path every commands submitted commands
+  // (never if 0) and once more after the last one. With fork, the periodic
+  // ones are written by a child process (see ShardedEngine::ForkSnapshot);
+  // one that comes due while the previous child still writes is skipped.
+  void SnapshotEvery(const char *path, std::uint64_t commands,
+                     bool fork = false) {
+    snapshot_path_ = path;
+    snapshot_every_ = commands;
+    fork_snapshots_ = fork;
+  }
+
+  // Feeds every line of reader through the stages and returns once all
+  // responses are written. Returns false if reading failed (reader.error()
+  // says why); the lines before the failure are still handled, but no final
+  // snapshot is written. Call at most once.
+  template <typename Reader> bool Run(Reader &reader) {
+    std::thread reader_thread(&Pipeline::ReadLines<Reader>, this,
+                              std::ref(reader));
+    std::vector<std::thread> parsers;
+    for (std::size_t i = 0; i < parser_count_; ++i)
+      parsers.emplace_back(&Pipeline::DecodeLines, this, i);
+
+    Dispatch();
+
+    reader_thread.join();
+    for (auto &parser : parsers)
+      parser.join();
+    engine_.Finish();
+    return read_error_ == 0;
+  }
+
+private:
+  // One line in flight. decoded is the line number + 1 once command and
+  // valid describe it; the slot is reused one ring size later.
+  struct Slot {
+    std::string line;
+    Command command;
+    bool valid;
+    std::atomic<std::uint64_t> decoded;
+  };
+
+  // Waits until line number is either read or known to be past the end.
+  // Returns false in the second case.
+  bool WaitForLine(std::uint64_t number) {
+    Backoff backoff;
+    while (number >= read_.load(std::memory_order_acquire)) {
+      if (eof_.load(std::memory_order_acquire) &&
+          number >= line_count_.load(std::memory_order_relaxed))
+        return false;
+      backoff.Pause();
+    }
+    return true;
+  }
+
+  // Reader stage.
+  template <typename Reader> void ReadLines(Reader &reader) {
+    LineView line;
+    std::uint64_t number = 0;
+    Backoff backoff;
+    while (reader.NextLine(line)) {
+      // Slot number is free once the line a lap before it was dispatched.
+      while (number - dispatched_.load(std::memory_order_acquire) >=
+             slots_.size())
+        backoff.Pause();
+      backoff.Reset();
+      slots_[number & mask_].line.assign(line.data, line.size);
+      read_.store(++number, std::memory_order_release);
+    }
+    line_count_.store(number, std::memory_order_relaxed);
+    read_error_ = reader.error();
+    eof_.store(true, std::memory_order_release);
+  }
+
+  // Parser stage, one thread per index.
+  void DecodeLines(std::size_t index) {
+    WorkStealingDeque &own = *deques_[index];
+    Message message;
+    std::uint64_t number;
+    Backoff backoff;
+    while (true) {
+      if (own.Pop(number) || StealLine(index, number)) {
+        Slot &slot = slots_[number & mask_];
+        slot.valid = DecodeCommand(slot.line.data(), slot.line.size(),
+                                   message, slot.command);
+        slot.decoded.store(number + 1, std::memory_order_release);
+        backoff.Reset();
+      } else if (ClaimLines(own)) {
+        backoff.Reset();
+      } else if (eof_.load(std::memory_order_acquire) &&
+                 claimed_.load(std::memory_order_relaxed) >=
+                     line_count_.load(std::memory_order_relaxed)) {
+        // Every line is claimed; whatever is still queued belongs to
+        // parsers that are going to decode it themselves.
+        return;
+      } else {
+        backoff.Pause();
+      }
+    }
+  }
+
+  // Takes the oldest line queued by another parser, starting with the next
+  // one over so thieves spread out.
+  bool StealLine(std::size_t index, std::uint64_t &number) {
+    for (std::size_t i = 1; i < parser_count_; ++i) {
+      if (deques_[(index + i) % parser_count_]->Steal(number))
+        return true;
+    }
+    return false;
+  }
+
+  // Claims up to kParseBatch lines that were read but not claimed yet and
+  // queues them on own so its owner pops them in line order (and thieves take
+  // the last ones). Returns false if there were none.
+  bool ClaimLines(WorkStealingDeque &own) {
+    std::uint64_t first = claimed_.load(std::memory_order_relaxed);
+    std::uint64_t end;
+    do {
+      const std::uint64_t read = read_.load(std::memory_order_acquire);
+      if (first >= read)
+        return false;
+      end = std::min<std::uint64_t>(first + kParseBatch, read);
+    } while (!claimed_.compare_exchange_weak(first, end,
+                                             std::memory_order_relaxed));
+    while (end-- > first)
+      own.Push(end);
+    return true;
+  }
+
+  // Dispatcher stage: submits decoded lines in line order.
+  void Dispatch() {
+    std::uint64_t submitted = 0;
+    for (std::uint64_t number = 0; WaitForLine(number); ++number) {
+      Slot &slot = slots_[number & mask_];
+      Backoff backoff;
+      while (slot.decoded.load(std::memory_order_acquire) != number + 1)
+        backoff.Pause();
+      // Lines that are not valid JSON, match neither schema or carry a bad
+      // time get no response.
+      if (slot.valid) {
+        engine_.Submit(slot.command);
+        if (++submitted == snapshot_every_) {
+          if (fork_snapshots_)
+            ForkSnapshot();
+          else
+            Snapshot();
+          submitted = 0;
+        } else if (submitted % kSnapshotPollEvery == 0 &&
+                   child_.running() && !child_.Poll()) {
+          ReportSnapshotFailure();
+        }
+      }
+      dispatched_.store(number + 1, std::memory_order_release);
+    }
+    if (!child_.Wait())
+      ReportSnapshotFailure();
+    // Input cut short by a read error is not a state worth restarting from.
+    if (read_error_ == 0)
+      Snapshot();
+  }
+
+  // A snapshot that fails is reported and skipped; the log still has every
+  // change.
+  void Snapshot() {
+    if (snapshot_path_ != nullptr && !engine_.Snapshot(snapshot_path_))
+      ReportSnapshotFailure();
+  }
+
+  void ForkSnapshot() {
+    if (!child_.Poll())
+      ReportSnapshotFailure();
+    if (!child_.running() && !engine_.ForkSnapshot(child_, snapshot_path_))
+      ReportSnapshotFailure();
+  }
+
+  void ReportSnapshotFailure() {
+    std::cerr << snapshot_path_ << ": " << std::strerror(errno) << "\n";
+  }
+
+  ShardedEngine engine_;
+  std::vector<Slot> slots_;
+  const std::size_t mask_;
+  const std::size_t parser_count_;
+  std::vector<std::unique_ptr<WorkStealingDeque>> deques_;
+  // Lines copied into slots so far, published by the reader.
+  std::atomic<std::uint64_t> read_;
+  // Lines taken by a parser so far.
+  std::atomic<std::uint64_t> claimed_;
+  // Lines handed to the engine so far, published by the dispatcher.
+  std::atomic<std::uint64_t> dispatched_;
+  // Set by the reader at end of input; line_count_ is the number of lines
+  // and read_error_ the reader's error(), both published by eof_.
+  std::atomic<bool> eof_;
+  std::atomic<std::uint64_t> line_count_;
+  int read_error_;
+  const char *snapshot_path_;
+  std::uint64_t snapshot_every_;
+  bool fork_snapshots_;
+  // Child writing the last forked snapshot, if it is still running.
+  ForkedSnapshot child_;
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef queue_h
+#define queue_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bytes kept between fields written by different threads so they never share
+// a cache line.
+const std::size_t kCacheLineSize = 64;
+
+// Smallest power of two that is at least size (and at least 1).
+std::size_t RoundUpToPowerOfTwo(std::size_t size) {
+  std::size_t power = 1;
+  while (power < size)
+    power *= 2;
+  return power;
+}
+
+// Waits in growing steps: a short busy spin, then yielding, then sleeping, so
+// an idle thread stops burning a core while a busy one reacts within
+// nanoseconds.
+class Backoff {
+public:
+  Backoff() : count_(0) {}
+
+  void Pause() {
+    if (count_ < kSpinLimit) {
+#if defined(__SSE2__)
+      _mm_pause();
+#endif
+    } else if (count_ < kYieldLimit) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      return;
+    }
+    ++count_;
+  }
+
+  void Reset() { count_ = 0; }
+
+private:
+  static const int kSpinLimit = 64;
+  static const int kYieldLimit = 128;
+
+  int count_;
+};
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Capacity is rounded up to a power of two. Each side keeps a cached
+// copy of the other side's index and only reloads it when the ring looks full
+// (or empty), so in steady state a push or pop touches no shared cache line
+// besides the item itself.
+template <typename T> class SpscRing {
+public:
+  explicit SpscRing(std::size_t capacity)
+      : items_(RoundUpToPowerOfTwo(capacity)), mask_(items_.size() - 1) {
+    head_.index.store(0, std::memory_order_relaxed);
+    head_.cache = 0;
+    tail_.index.store(0, std::memory_order_relaxed);
+    tail_.cache = 0;
+  }
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  std::size_t capacity() const { return items_.size(); }
+
+  // Producer side. Returns false if the ring is full.
+  bool TryPush(const T &item) {
+    const std::size_t tail = tail_.index.load(std::memory_order_relaxed);
+    if (tail - tail_.cache == items_.size()) {
+      tail_.cache = head_.index.load(std::memory_order_acquire);
+      if (tail - tail_.cache == items_.size())
+        return false;
+    }
+    items_[tail & mask_] = item;
+    tail_.index.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the ring is empty.
+  bool TryPop(T &item) {
+    const std::size_t head = head_.index.load(std::memory_order_relaxed);
+    if (head == head_.cache) {
+      head_.cache = tail_.index.load(std::memory_order_acquire);
+      if (head == head_.cache)
+        return false;
+    }
+    item = items_[head & mask_];
+    head_.index.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  void Push(const T &item) {
+    Backoff backoff;
+    while (!TryPush(item))
+      backoff.Pause();
+  }
+
+  void Pop(T &item) {
+    Backoff backoff;
+    while (!TryPop(item))
+      backoff.Pause();
+  }
+
+private:
+  // Index owned by one side plus its cached copy of the other side's index,
+  // padded away from whatever precedes it.
+  struct Side {
+    char pad[kCacheLineSize];
+    std::atomic<std::size_t> index;
+    std::size_t cache;
+  };
+
+  std::vector<T> items_;
+  const std::size_t mask_;
+  // Consumer: next item to pop and the last tail it saw.
+  Side head_;
+  // Producer: next slot to fill and the last head it saw.
+  Side tail_;
+};
+
+// Bounded Chase-Lev work-stealing deque of integers. The owning thread
+// pushes and pops at the bottom like a stack; any other thread may steal from
+// the top, taking the oldest item. Only the last item is contended, and it
+// is settled with a single compare-and-swap on top. Memory orderings follow
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.).
+// The owner must not push more than capacity() items ahead of the thieves.
+class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(std::size_t capacity)
+      : items_(RoundUpToPowerOfTwo(capacity)), mask_(items_.size() - 1) {
+    top_.value.store(0, std::memory_order_relaxed);
+    bottom_.value.store(0, std::memory_order_relaxed);
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  std::size_t capacity() const { return items_.size(); }
+
+  // Owner only. Returns false if the deque is full.
+  bool Push(std::uint64_t item) {
+    const std::int64_t bottom = bottom_.value.load(std::memory_order_relaxed);
+    const std::int64_t top = top_.value.load(std::memory_order_acquire);
+    if (bottom - top >= (std::int64_t)items_.size())
+      return false;
+    items_[bottom & mask_].store(item, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.value.store(bottom + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Owner only. Takes the newest item, or returns false if there is none.
+  bool Pop(std::uint64_t &item) {
+    const std::int64_t bottom =
+        bottom_.value.load(std::memory_order_relaxed) - 1;
+    bottom_.value.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t top = top_.value.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      bottom_.value.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    item = items_[bottom & mask_].load(std::memory_order_relaxed);
+    if (top == bottom) {
+      // Last item: race the thieves for it.
+      const bool won = top_.value.compare_exchange_strong(
+          top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom_.value.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread. Takes the oldest item, or returns false if the deque looked
+  // empty or another thread took that item first.
+  bool Steal(std::uint64_t &item) {
+    std::int64_t top = top_.value.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const std::int64_t bottom = bottom_.value.load(std::memory_order_acquire);
+    if (top >= bottom)
+      return false;
+    item = items_[top & mask_].load(std::memory_order_relaxed);
+    return top_.value.compare_exchange_strong(
+        top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+  }
+
+private:
+  // Padded like SpscRing::Side; top_ is shared, bottom_ belongs to the owner.
+  struct Index {
+    char pad[kCacheLineSize];
+    std::atomic<std::int64_t> value;
+  };
+
+  std::vector<std::atomic<std::uint64_t>> items_;
+  const std::size_t mask_;
+  Index top_;
+  Index bottom_;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef reader_h
+#define reader_h
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bytes of one input line, without the trailing newline. The bytes belong to
+// whoever produced the view (std::string_view needs C++17).
+struct LineView {
+  const char *data;
+  std::size_t size;
+};
+
+// Returns the first '\n' in [begin, end), or end if there is none. Scans 16
+// bytes per step with SSE2 when available.
+const char *FindNewline(const char *begin, const char *end) {
+  const char *p = begin;
+#if defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == '\n')
+      return p;
+  }
+  return end;
+}
+
+// Reads a file descriptor in large chunks into one reusable buffer and hands
+// out the lines in it as views, avoiding iostream and a copy per line. A line
+// that straddles two chunks is moved to the front of the buffer before the
+// next read, and the buffer grows if a single line does not fit.
+class LineReader {
+public:
+  static const std::size_t kDefaultChunkSize = 1 << 20;
+
+  explicit LineReader(int fd, std::size_t chunk_size = kDefaultChunkSize)
+      : fd_(fd), buffer_(chunk_size > 0 ? chunk_size : 1), begin_(0), end_(0),
+        scanned_(0), eof_(false), error_(0) {}
+
+  // Stores the next line in line and returns true, or returns false once the
+  // input is exhausted. line stays valid until the next call. A last line
+  // without a trailing newline is still returned.
+  bool NextLine(LineView &line) {
+    while (true) {
+      const char *base = buffer_.data();
+      const char *newline = FindNewline(base + scanned_, base + end_);
+      if (newline != base + end_) {
+        line.data = base + begin_;
+        line.size = newline - line.data;
+        begin_ = scanned_ = newline - base + 1;
+        return true;
+      }
+      scanned_ = end_;
+      if (eof_) {
+        if (begin_ == end_)
+          return false;
+        line.data = base + begin_;
+        line.size = end_ - begin_;
+        begin_ = scanned_ = end_;
+        return true;
+      }
+      Fill();
+    }
+  }
+
+  // The errno of the read that stopped reading, or 0 if it stopped at the
+  // end of input.
+  int error() const { return error_; }
+
+private:
+  // Moves the partial line to the front, growing the buffer if it is already
+  // full, and reads as much as fits after it.
+  void Fill() {
+    if (begin_ > 0) {
+      std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      scanned_ -= begin_;
+      begin_ = 0;
+    }
+    if (end_ == buffer_.size())
+      buffer_.resize(buffer_.size() * 2);
+
+    ssize_t count;
+    do {
+      count = read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+      eof_ = true;
+      error_ = count < 0 ? errno : 0;
+      return;
+    }
+    end_ += count;
+  }
+
+  int fd_;
+  std::vector<char> buffer_;
+  // Unconsumed bytes are [begin_, end_); [begin_, scanned_) has no newline.
+  std::size_t begin_;
+  std::size_t end_;
+  std::size_t scanned_;
+  bool eof_;
+  int error_;
+};
+
+// Maps a whole file read-only and hands out its lines as views straight into
+// the mapping, for replaying large captures without read() copies. The kernel
+// is told the access is sequential (and asked for huge pages where supported)
+// so readahead stays ahead of the scan.
+class MappedLineReader {
+public:
+  MappedLineReader() : data_(nullptr), size_(0), offset_(0) {}
+
+  ~MappedLineReader() {
+    if (data_ != nullptr)
+      munmap((void *)data_, size_);
+  }
+
+  MappedLineReader(const MappedLineReader &) = delete;
+  MappedLineReader &operator=(const MappedLineReader &) = delete;
+
+  // Maps path. Returns false and leaves errno set if it can not be opened or
+  // mapped; an empty file maps to no lines. Anything but a regular file (a
+  // pipe, a device) fails with ENODEV, as its size says nothing about how
+  // much there is to read.
+  bool Open(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    int failure = 0;
+    if (fstat(fd, &st) != 0)
+      failure = errno;
+    else if (!S_ISREG(st.st_mode))
+      failure = ENODEV;
+    if (failure != 0) {
+      close(fd);
+      errno = failure;
+      return false;
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        size_ = 0;
+        return false;
+      }
+      data_ = (const char *)data;
+      madvise(data, size_, MADV_SEQUENTIAL);
+#if defined(MADV_HUGEPAGE)
+      madvise(data, size_, MADV_HUGEPAGE);
+#endif
+    }
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    return true;
+  }
+
+  // Same contract as LineReader::NextLine; views stay valid for the life of
+  // the reader.
+  bool NextLine(LineView &line) {
+    if (offset_ == size_)
+      return false;
+    const char *begin = data_ + offset_;
+    const char *end = data_ + size_;
+    const char *newline = FindNewline(begin, end);
+    line.data = begin;
+    line.size = newline - begin;
+    offset_ = newline == end ? size_ : newline - data_ + 1;
+    return true;
+  }
+
+  int error() const { return 0; }
+
+private:
+  const char *data_;
+  std::size_t size_;
+  std::size_t offset_;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef recovery_h
+#define recovery_h
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "engine.h"
+#include "globals.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "wal.h"
+
+// What Restore or RecoverFromLog found.
+struct RestoreStats {
+  // Accounts loaded from the snapshot, or in it for RecoverFromLog.
+  std::uint64_t accounts = 0;
+  std::uint64_t replayed = 0;
+  // Bytes of a record torn by a crash, cut off the end of the log.
+  std::uint64_t truncated = 0;
+};
+
+// What a log record asks of replay.
+enum ReplayStep {
+  // Nothing to redo; the record only names a merchant.
+  kReplayNothing = 0,
+  // Redo the command.
+  kReplayCommand,
+  // The record can not come from an intact log.
+  kReplayCorrupt,
+};
+
+// Turns a log record into the command that replays it, translating its
+// merchant through merchant_ids (log id to this process' id), which
+// kWalMerchantName records update. A transaction whose merchant the log
+// never named is corrupt: skipping it would rebuild a different state than
+// the one logged.
+ReplayStep ToReplayCommand(const WalRecord &record,
+                           std::vector<std::uint32_t> &merchant_ids,
+                           Command &command) {
+  switch (record.type) {
+  case kWalMerchantName:
+    if (merchant_ids.size() <= record.merchant_id)
+      merchant_ids.resize(record.merchant_id + 1, 0xffffffff);
+    merchant_ids[record.merchant_id] = InternMerchant(
+        record.merchant_name.data, record.merchant_name.size);
+    return kReplayNothing;
+  case kWalAccountCreated:
+    command.type = kAccountMessage;
+    command.account = record.account;
+    return kReplayCommand;
+  default:
+    break;
+  }
+  // WalReader reports records of any other type as corruption.
+  assert(record.type == kWalTransactionApplied);
+  if (record.transaction.merchant >= merchant_ids.size() ||
+      merchant_ids[record.transaction.merchant] == 0xffffffff)
+    return kReplayCorrupt;
+  command.type = kTransactionMessage;
+  command.transaction = record.transaction;
+  command.transaction.merchant = merchant_ids[record.transaction.merchant];
+  return kReplayCommand;
+}
+
+// Replays the changes of log, read from wal_path, into target, up to offset
+// until or the end of the valid records, whichever comes first. Only a torn
+// tail may end the valid records early. Returns false and sets error,
+// naming the record's offset, at a corrupt record.
+template <typename Target>
+bool ReplayLog(const char *wal_path, WalReader &log, std::uint64_t until,
+               std::vector<std::uint32_t> &merchant_ids, Target &target,
+               RestoreStats &stats, std::string &error) {
+  WalRecord record;
+  Command command;
+  while (log.offset() < until) {
+    const std::uint64_t offset = log.offset();
+    if (!log.Next(record)) {
+      if (log.corruption() == nullptr)
+        return true;
+      error = std::string(wal_path) + ": record at offset " +
+              std::to_string(offset) + " " + log.corruption();
+      return false;
+    }
+    switch (ToReplayCommand(record, merchant_ids, command)) {
+    case kReplayNothing:
+      break;
+    case kReplayCommand:
+      if (!target.Replay(command)) {
+        error = std::string(wal_path) + ": record at offset " +
+                std::to_string(offset) +
+                (command.type == kAccountMessage
+                     ? " creates account " +
+                           std::to_string(command.account.id) +
+                           ", which already exists"
+                     : " charges account " +
+                           std::to_string(command.transaction.account) +
+                           ", which does not exist");
+        return false;
+      }
+      ++stats.replayed;
+      break;
+    case kReplayCorrupt:
+      error = std::string(wal_path) + ": record at offset " +
+              std::to_string(offset) + " charges merchant " +
+              std::to_string(record.transaction.merchant) +
+              ", which the log never named";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that a snapshot cut from the log with wal_identity (see
+// WalIdentity) can be continued with log, read from wal_path: replaying a
+// log the snapshot was not cut from would apply changes twice or skip them.
+// A snapshot cut before its log had any records fits any log, and one
+// written without a log only fits a log without records. Returns false and
+// sets error if it does not fit.
+bool CheckSnapshotLog(const char *snapshot_path, std::uint64_t wal_identity,
+                      const char *wal_path, const WalReader &log,
+                      std::string &error) {
+  if (wal_identity == 0 && log.identity() != kWalWithoutRecords) {
+    error = std::string(snapshot_path) + " was written without a log, but " +
+            wal_path + " has changes";
+    return false;
+  }
+  if (wal_identity != 0 && wal_identity != kWalWithoutRecords &&
+      wal_identity != log.identity()) {
+    error = std::string(snapshot_path) + " was not cut from " + wal_path;
+    return false;
+  }
+  return true;
+}
+
+// Cuts the torn record that follows the valid records of log, read from
+// wal_path, off the file, so new records can be appended after them. Only
+// for a log ReplayLog read to its end without finding corruption. Returns
+// false and sets error on failure.
+bool CutTornTail(const char *wal_path, const WalReader &log,
+                 RestoreStats &stats, std::string &error) {
+  if (log.offset() == log.size())
+    return true;
+  stats.truncated = log.size() - log.offset();
+  if (truncate(wal_path, log.offset()) != 0) {
+    error = std::string(wal_path) + ": " + std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+// Rebuilds the state a previous run left behind into target, which must be
+// empty: the accounts of the snapshot at snapshot_path (none if there is no
+// such file), then every change logged after it in the log at wal_path
+// (none if there is no such file). Either path may be null. Target is an
+// Engine or a ShardedEngine; anything with
+//
+//   void Import(std::uint64_t id, const User &user);
+//   bool Replay(const Command &command);
+//
+// will do. A torn record at the end of the log is cut off so new records
+// can be appended after the valid ones. Returns false and sets error on
+// failure.
+template <typename Target>
+bool Restore(const char *snapshot_path, const char *wal_path, Target &target,
+             RestoreStats &stats, std::string &error) {
+  bool restored = false;
+  std::uint64_t wal_offset = 0;
+  std::uint64_t wal_identity = 0;
+  std::vector<std::uint32_t> merchant_ids;
+  if (snapshot_path != nullptr) {
+    SnapshotReader snapshot;
+    if (snapshot.Open(snapshot_path)) {
+      restored = true;
+      std::uint64_t id;
+      User user(false, 0);
+      while (snapshot.Next(id, user)) {
+        target.Import(id, user);
+        ++stats.accounts;
+      }
+      if (snapshot.error()) {
+        error = std::string(snapshot_path) +
+                ": malformed account or digest mismatch";
+        return false;
+      }
+      wal_offset = snapshot.wal_offset();
+      wal_identity = snapshot.wal_identity();
+      // Until the log names them again, its ids are the snapshot's.
+      merchant_ids = snapshot.merchant_ids();
+    } else if (errno != ENOENT) {
+      error = std::string(snapshot_path) + ": " + std::strerror(errno);
+      return false;
+    }
+  }
+
+  if (wal_path == nullptr)
+    return true;
+  WalReader log;
+  if (!log.Open(wal_path, wal_offset)) {
+    if (errno == ENOENT && wal_offset == 0)
+      return true;
+    error = std::string(wal_path) + ": " +
+            (errno == EINVAL ? "not a log, or shorter than the snapshot"
+                             : std::strerror(errno));
+    return false;
+  }
+  if (restored &&
+      !CheckSnapshotLog(snapshot_path, wal_identity, wal_path, log, error))
+    return false;
+  return ReplayLog(wal_path, log, UINT64_MAX, merchant_ids, target, stats,
+                   error) &&
+         CutTornTail(wal_path, log, stats, error);
+}
+
+// Rebuilds the state from the whole log at wal_path alone into target,
+// which must be empty, for when a snapshot is missing or not trusted. This
+// thread only reads and checks the records; target's shards each replay
+// the records of their own accounts, so replay runs on as many cores as
+// there are shards. If there is a snapshot at snapshot_path (which may be
+// null), the state as replay passes the snapshot's cut must have the
+// snapshot's digest, which catches a log and a snapshot that disagree. A
+// torn tail is cut off like Restore does. Stores the digest of the final
+// state in digest. Returns false and sets error on failure or mismatch.
+bool RecoverFromLog(const char *snapshot_path, const char *wal_path,
+                    ShardedEngine &target, RestoreStats &stats,
+                    std::uint64_t &digest, std::string &error) {
+  bool check = false;
+  std::uint64_t cut = 0;
+  std::uint64_t cut_identity = 0;
+  std::uint64_t expected = 0;
+  if (snapshot_path != nullptr) {
+    SnapshotReader snapshot;
+    if (snapshot.Open(snapshot_path)) {
+      check = true;
+      cut = snapshot.wal_offset();
+      cut_identity = snapshot.wal_identity();
+      expected = snapshot.digest();
+      stats.accounts = snapshot.account_count();
+    } else if (errno != ENOENT) {
+      error = std::string(snapshot_path) + ": " + std::strerror(errno);
+      return false;
+    }
+  }
+
+  WalReader log;
+  if (!log.Open(wal_path)) {
+    error = std::string(wal_path) + ": " +
+            (errno == EINVAL ? "not a log" : std::strerror(errno));
+    return false;
+  }
+  std::vector<std::uint32_t> merchant_ids;
+  if (check) {
+    if (!CheckSnapshotLog(snapshot_path, cut_identity, wal_path, log, error) ||
+        !ReplayLog(wal_path, log, cut, merchant_ids, target, stats, error))
+      return false;
+    if (log.offset() != cut) {
+      error = std::string(wal_path) + ": ends before the snapshot";
+      return false;
+    }
+    if (target.Digest() != expected) {
+      error = std::string(wal_path) + ": replay does not match " +
+              snapshot_path;
+      return false;
+    }
+  }
+  if (!ReplayLog(wal_path, log, UINT64_MAX, merchant_ids, target, stats,
+                 error) ||
+      !CutTornTail(wal_path, log, stats, error))
+    return false;
+  digest = target.Digest();
+  return true;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef reorder_h
+#define reorder_h
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "queue.h"
+
+// Puts results that arrive out of order back into sequence order. Values are
+// stored by sequence number in a fixed ring of capacity slots (rounded up to
+// a power of two) and handed out strictly in order starting at 0, so memory
+// is bounded no matter how far results arrive ahead of the one being waited
+// for. Whoever assigns sequence numbers must keep them below
+// next() + capacity().
+template <typename T> class ReorderBuffer {
+public:
+  explicit ReorderBuffer(std::size_t capacity)
+      : slots_(RoundUpToPowerOfTwo(capacity)), mask_(slots_.size() - 1),
+        next_(0) {}
+
+  std::size_t capacity() const { return slots_.size(); }
+
+  // Sequence number the next Pop hands out.
+  std::uint64_t next() const { return next_; }
+
+  // Stores the result for sequence, which must be in
+  // [next(), next() + capacity()) and not stored yet.
+  void Put(std::uint64_t sequence, const T &value) {
+    assert(sequence >= next_ && sequence - next_ < slots_.size());
+    Slot &slot = slots_[sequence & mask_];
+    assert(!slot.full);
+    slot.value = value;
+    slot.full = true;
+  }
+
+  // Moves the result for next() into value and advances, or returns false
+  // if it has not arrived yet.
+  bool Pop(T &value) {
+    Slot &slot = slots_[next_ & mask_];
+    if (!slot.full)
+      return false;
+    value = slot.value;
+    slot.full = false;
+    ++next_;
+    return true;
+  }
+
+private:
+  struct Slot {
+    T value;
+    bool full = false;
+  };
+
+  std::vector<Slot> slots_;
+  const std::size_t mask_;
+  std::uint64_t next_;
+};
+
+#endif
@@ -0,0 +1,506 @@
+#ifndef shards_h
+#define shards_h
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "accounts.h"
+#include "balance.h"
+#include "digest.h"
+#include "engine.h"
+#include "queue.h"
+#include "reorder.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "writer.h"
+
+// An account in transit between two shards. The shard giving it up fills
+// in user (left empty if the account does not exist yet) and sets ready; the
+// shard taking it over waits for ready, adopts the account and deletes the
+// handoff.
+struct AccountHandoff {
+  explicit AccountHandoff(std::uint64_t account_id)
+      : id(account_id), ready(false) {}
+
+  const std::uint64_t id;
+  std::unique_ptr<User> user;
+  std::atomic<bool> ready;
+};
+
+// Meeting point of every shard for a snapshot. Each shard encodes its
+// accounts into its part when it reaches the snapshot in its queue, then
+// waits for the others, so no shard logs a change made after the snapshot
+// while another still logs one made before it. The last to arrive records
+// where the log ends, which is where replay starts from the snapshot.
+//
+// A barrier that does not encode only parks the shards: whoever pushed it
+// reads their engines once every shard has arrived and releases them.
+struct SnapshotBarrier {
+  SnapshotBarrier(std::size_t shard_count, WriteAheadLog *wal,
+                  bool encode_parts = true)
+      : parts(shard_count), log(wal), encode(encode_parts), log_end(0),
+        arrived(0), left(0), released(false) {}
+
+  std::vector<SnapshotPart> parts;
+  WriteAheadLog *log;
+  const bool encode;
+  std::uint64_t log_end;
+  std::atomic<std::size_t> arrived;
+  std::atomic<std::size_t> left;
+  std::atomic<bool> released;
+};
+
+// Work item for a shard.
+struct ShardInput {
+  enum Kind {
+    kStop = 0,
+    // Evaluate command; its response is the sequence-th of the output,
+    // counted from 0.
+    kEvaluate,
+    // Give up, or take over, the account of handoff.
+    kExport,
+    kImport,
+    // Redo command, read back from the log; there is no response.
+    kReplay,
+    // Encode the accounts into part sequence of snapshot.
+    kSnapshot,
+  };
+
+  Kind kind = kStop;
+  std::uint64_t sequence = 0;
+  Command command;
+  AccountHandoff *handoff = nullptr;
+  SnapshotBarrier *snapshot = nullptr;
+};
+
+// A response and the sequence number of the command it answers.
+struct ShardOutput {
+  std::uint64_t sequence;
+  Response response;
+};
+
+// A worker thread with the Engine for the accounts routed to it. Commands
+// come in through input() and their responses leave through output() in the
+// same order, so every account sees its messages in input order.
+class Shard {
+public:
+  explicit Shard(std::size_t queue_capacity, WriteAheadLog *log = nullptr)
+      : engine_(log), input_(queue_capacity), output_(queue_capacity) {}
+
+  Shard(const Shard &) = delete;
+  Shard &operator=(const Shard &) = delete;
+
+  // Stops the thread if Stop was not called. Responses must have been
+  // drained, otherwise the worker can be stuck on a full output.
+  ~Shard() { Stop(); }
+
+  void Start() { thread_ = std::thread(&Shard::Run, this); }
+
+  // Queues a stop behind the pending commands and waits for the thread.
+  void Stop() {
+    if (!thread_.joinable())
+      return;
+    input_.Push(ShardInput());
+    thread_.join();
+  }
+
+  SpscRing<ShardInput> &input() { return input_; }
+  SpscRing<ShardOutput> &output() { return output_; }
+
+  // Only safe to read while the thread waits at a snapshot that does not
+  // encode, or once it stopped.
+  const Engine &engine() const { return engine_; }
+
+private:
+  // Most commands evaluated in one Engine::HandleBatch call.
+  static const std::size_t kBatchSize = 64;
+
+  // Takes whatever commands are queued, up to kBatchSize, and evaluates them
+  // as one batch so their cache misses overlap. A control item ends the
+  // batch and runs after the commands before it; running out of queued
+  // commands ends it too, so nothing waits for a batch to fill.
+  void Run() {
+    ShardInput in;
+    Command commands[kBatchSize];
+    std::uint64_t sequences[kBatchSize];
+    Response responses[kBatchSize];
+    ShardOutput out;
+    Backoff backoff;
+    while (true) {
+      std::size_t count = 0;
+      bool control = false;
+      while (count < kBatchSize && input_.TryPop(in)) {
+        if (in.kind != ShardInput::kEvaluate) {
+          control = true;
+          break;
+        }
+        commands[count] = in.command;
+        sequences[count] = in.sequence;
+        ++count;
+      }
+      if (count == 0 && !control) {
+        backoff.Pause();
+        continue;
+      }
+      backoff.Reset();
+
+      engine_.HandleBatch(commands, count, responses);
+      for (std::size_t i = 0; i < count; ++i) {
+        out.sequence = sequences[i];
+        out.response = responses[i];
+        output_.Push(out);
+      }
+      if (control && !HandleControl(in))
+        return;
+    }
+  }
+
+  // Runs a stop, export or import. Returns false for a stop.
+  bool HandleControl(ShardInput &in) {
+    switch (in.kind) {
+    case ShardInput::kExport:
+      engine_.Export(in.handoff->id, in.handoff->user);
+      in.handoff->ready.store(true, std::memory_order_release);
+      return true;
+    case ShardInput::kImport: {
+      // The exporting shard never waits on this one, so this ends as soon
+      // as it reaches the export.
+      Backoff backoff;
+      while (!in.handoff->ready.load(std::memory_order_acquire))
+        backoff.Pause();
+      if (in.handoff->user)
+        engine_.Import(in.handoff->id, *in.handoff->user);
+      delete in.handoff;
+      return true;
+    }
+    case ShardInput::kReplay:
+      // ShardedEngine::Replay only queues changes that apply.
+      engine_.Replay(in.command);
+      return true;
+    case ShardInput::kSnapshot:
+      MeetForSnapshot(*in.snapshot, in.sequence);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  void MeetForSnapshot(SnapshotBarrier &barrier, std::uint64_t part) {
+    if (barrier.encode)
+      AddAccounts(engine_, barrier.parts[part]);
+    if (barrier.arrived.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+            barrier.parts.size() &&
+        barrier.encode) {
+      if (barrier.log != nullptr)
+        barrier.log_end = barrier.log->end_offset();
+      barrier.released.store(true, std::memory_order_release);
+    } else {
+      Backoff backoff;
+      while (!barrier.released.load(std::memory_order_acquire))
+        backoff.Pause();
+    }
+    barrier.left.fetch_add(1, std::memory_order_release);
+  }
+
+  Engine engine_;
+  SpscRing<ShardInput> input_;
+  SpscRing<ShardOutput> output_;
+  std::thread thread_;
+};
+
+// Runs an Engine per worker thread, with accounts partitioned between them
+// by a LoadBalancer, and a writer thread that renders the responses to a
+// stream.
+//
+// When the balancer moves an account, the old shard gets an export and the
+// new one an import right before the account's next command. Both shards
+// see these in their queue order, so every command before the move is
+// evaluated with the old shard's state and every command after it with the
+// same state carried over, windows included.
+//
+// Commands are numbered as they are submitted. Shards finish them at their
+// own pace, so the writer collects every shard's output into a
+// ReorderBuffer and writes responses strictly in submission order, which
+// makes the output identical to one Engine handling every command. Submit
+// never lets the oldest unwritten response fall more than the buffer's
+// capacity behind, which bounds memory when one shard lags the others.
+//
+// Unordered engines skip the reordering: responses are written as soon as
+// they arrive, each tagged with its sequence number.
+//
+// With a log, shards record their changes in it as they make them (a moved
+// account's records on its old shard come before the export, so each
+// account's records stay in order) and the writer syncs the log before it
+// lets any response out.
+class ShardedEngine {
+public:
+  static const std::size_t kDefaultQueueCapacity = 1024;
+  static const std::size_t kDefaultReorderCapacity = 16384;
+
+  ShardedEngine(std::size_t shard_count, std::ostream &out,
+                bool ordered = true,
+                std::size_t queue_capacity = kDefaultQueueCapacity,
+                std::size_t reorder_capacity = kDefaultReorderCapacity,
+                WriteAheadLog *log = nullptr)
+      : balancer_(shard_count), out_(out), ordered_(ordered),
+        reorder_(reorder_capacity), log_(log),
+        submitted_(0), written_(0), closed_(false) {
+    assert(shard_count > 0);
+    for (std::size_t i = 0; i < shard_count; ++i) {
+      shards_.emplace_back(new Shard(queue_capacity, log));
+      shards_.back()->Start();
+    }
+    writer_thread_ = std::thread(&ShardedEngine::WriteResponses, this);
+  }
+
+  ShardedEngine(const ShardedEngine &) = delete;
+  ShardedEngine &operator=(const ShardedEngine &) = delete;
+
+  ~ShardedEngine() { Finish(); }
+
+  std::size_t shard_count() const { return shards_.size(); }
+
+  // Routing decisions so far; only for the submitting thread.
+  const LoadBalancer &balancer() const { return balancer_; }
+
+  // Hands command to the shard of its account, waiting while the shard's
+  // queue is full or the response would not fit in the reorder window.
+  void Submit(const Command &command) {
+    if (!restored_.empty())
+      std::unordered_set<std::uint64_t>().swap(restored_);
+    ShardInput in;
+    in.kind = ShardInput::kEvaluate;
+    in.sequence = submitted_;
+    in.command = command;
+    Backoff backoff;
+    while (in.sequence - written_.load(std::memory_order_acquire) >=
+           reorder_.capacity())
+      backoff.Pause();
+    std::size_t owner;
+    const std::size_t shard = balancer_.Route(command.account_id(), owner);
+    if (shard != owner)
+      Move(command.account_id(), owner, shard);
+    shards_[shard]->input().Push(in);
+    ++submitted_;
+  }
+
+  // Adopts an account read from a snapshot, on the shard that owns it.
+  // Like Replay, only for a new engine, before any Submit.
+  void Import(std::uint64_t id, const User &user) {
+    restored_.insert(id);
+    ShardInput in;
+    in.kind = ShardInput::kImport;
+    in.handoff = new AccountHandoff(id);
+    in.handoff->user.reset(new User(user));
+    in.handoff->ready.store(true, std::memory_order_relaxed);
+    shards_[balancer_.ShardFor(id)]->input().Push(in);
+  }
+
+  // Redoes a change read back from the log on the shard that owns its
+  // account. The shard replays it later, so whether the change could have
+  // been logged (see Engine::Replay) is checked against the accounts
+  // imported or replayed so far; returns false, changing nothing, if not.
+  bool Replay(const Command &command) {
+    if (command.type == kAccountMessage) {
+      if (!restored_.insert(command.account.id).second)
+        return false;
+    } else if (restored_.count(command.transaction.account) == 0) {
+      return false;
+    }
+    ShardInput in;
+    in.kind = ShardInput::kReplay;
+    in.command = command;
+    shards_[balancer_.ShardFor(command.account_id())]->input().Push(in);
+    return true;
+  }
+
+  // Writes a snapshot of every account as of the commands submitted so far
+  // to path (see WriteSnapshot). Shards only stop to encode their accounts;
+  // the file is written by the calling thread while they go on. Returns
+  // false and leaves errno set if it could not be written.
+  bool Snapshot(const char *path) {
+    SnapshotBarrier barrier(shards_.size(), log_);
+    QueueBarrier(barrier);
+    WaitUntilLeft(barrier);
+    if (log_ != nullptr)
+      log_->Sync();
+    return WriteSnapshot(path, barrier.log_end, IdentityOf(log_),
+                         barrier.parts.data(), barrier.parts.size());
+  }
+
+  // Like Snapshot, except that a child forked by child writes the file
+  // while the shards wait at a barrier, so they only stop for the fork
+  // rather than for encoding their accounts. The snapshot is published
+  // when child is polled or waited for after the child is done. Returns
+  // false and leaves errno set if no child was started, EBUSY if child is
+  // still busy with an earlier snapshot.
+  bool ForkSnapshot(ForkedSnapshot &child, const char *path) {
+    if (child.running()) {
+      errno = EBUSY;
+      return false;
+    }
+    SnapshotBarrier barrier(shards_.size(), log_, false);
+    QueueBarrier(barrier);
+    WaitUntilArrived(barrier);
+    const bool started =
+        child.Start(path, log_, [this](SnapshotFile &file) {
+          for (const auto &shard : shards_)
+            file.Add(shard->engine());
+        });
+    const int error = errno;
+    barrier.released.store(true, std::memory_order_release);
+    WaitUntilLeft(barrier);
+    errno = error;
+    return started;
+  }
+
+  // StateDigest of every account as of the commands submitted so far. The
+  // shards wait at a barrier while their digests are computed, one thread
+  // each.
+  std::uint64_t Digest() {
+    SnapshotBarrier barrier(shards_.size(), log_, false);
+    QueueBarrier(barrier);
+    WaitUntilArrived(barrier);
+    std::vector<std::uint64_t> digests(shards_.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+      threads.emplace_back(
+          [&, i] { digests[i] = StateDigest(shards_[i]->engine()); });
+    for (auto &thread : threads)
+      thread.join();
+    barrier.released.store(true, std::memory_order_release);
+    WaitUntilLeft(barrier);
+    std::uint64_t digest = 0;
+    for (std::uint64_t part : digests)
+      digest += part;
+    return digest;
+  }
+
+  // Waits until every submitted command's response has been written and
+  // flushed, then stops all threads. Nothing may be submitted afterwards.
+  void Finish() {
+    if (!writer_thread_.joinable())
+      return;
+    total_.store(submitted_, std::memory_order_relaxed);
+    closed_.store(true, std::memory_order_release);
+    writer_thread_.join();
+    for (auto &shard : shards_)
+      shard->Stop();
+  }
+
+private:
+  // Queues barrier behind the pending commands of every shard.
+  void QueueBarrier(SnapshotBarrier &barrier) {
+    ShardInput in;
+    in.kind = ShardInput::kSnapshot;
+    in.snapshot = &barrier;
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+      in.sequence = i;
+      shards_[i]->input().Push(in);
+    }
+  }
+
+  // Waits until every shard waits at barrier.
+  void WaitUntilArrived(SnapshotBarrier &barrier) {
+    Backoff backoff;
+    while (barrier.arrived.load(std::memory_order_acquire) != shards_.size())
+      backoff.Pause();
+  }
+
+  // Waits until no shard touches barrier any more.
+  void WaitUntilLeft(SnapshotBarrier &barrier) {
+    Backoff backoff;
+    while (barrier.left.load(std::memory_order_acquire) != shards_.size())
+      backoff.Pause();
+  }
+
+  // Queues the hand-over of account id from shard from to shard to.
+  void Move(std::uint64_t id, std::size_t from, std::size_t to) {
+    ShardInput in;
+    in.handoff = new AccountHandoff(id);
+    in.kind = ShardInput::kExport;
+    shards_[from]->input().Push(in);
+    in.kind = ShardInput::kImport;
+    shards_[to]->input().Push(in);
+  }
+
+  // Body of the writer thread. Output is flushed whenever it is full and
+  // whenever the thread runs out of responses to write, so an interactive
+  // reader sees each response without waiting for more input.
+  void WriteResponses() {
+    ResponseWriter writer;
+    ShardOutput out;
+    Response response;
+    std::uint64_t written = 0;
+    Backoff backoff;
+    while (true) {
+      bool progress = false;
+      for (auto &shard : shards_) {
+        while (shard->output().TryPop(out)) {
+          progress = true;
+          if (ordered_) {
+            reorder_.Put(out.sequence, out.response);
+          } else {
+            writer.AppendTaggedResponse(out.sequence, out.response);
+            ++written;
+          }
+        }
+      }
+      while (ordered_ && reorder_.Pop(response)) {
+        writer.AppendResponse(response);
+        ++written;
+      }
+      written_.store(written, std::memory_order_release);
+      if (writer.Full())
+        Flush(writer);
+      if (progress) {
+        backoff.Reset();
+        continue;
+      }
+      if (writer.size() > 0)
+        Flush(writer);
+      if (closed_.load(std::memory_order_acquire) &&
+          written == total_.load(std::memory_order_relaxed))
+        return;
+      backoff.Pause();
+    }
+  }
+
+  // Writes out what writer holds once the changes behind it are durable.
+  // Every response in writer was popped after its shard logged the change,
+  // so syncing now covers them all.
+  void Flush(ResponseWriter &writer) {
+    if (log_ != nullptr)
+      log_->Sync();
+    writer.Flush(out_);
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  // Only touched by the submitting thread.
+  LoadBalancer balancer_;
+  std::ostream &out_;
+  const bool ordered_;
+  // Only touched by the writer thread, apart from its fixed capacity.
+  ReorderBuffer<Response> reorder_;
+  WriteAheadLog *log_;
+  // Only touched by the submitting thread.
+  std::uint64_t submitted_;
+  // Accounts imported or replayed, until the first Submit.
+  std::unordered_set<std::uint64_t> restored_;
+  // Responses written so far, published by the writer thread.
+  std::atomic<std::uint64_t> written_;
+  // Set once no more commands will be submitted; total_ is their count.
+  std::atomic<bool> closed_;
+  std::atomic<std::uint64_t> total_;
+  std::thread writer_thread_;
+};
+
+#endif
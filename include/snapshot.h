@@ -0,0 +1,555 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "engine.h"
+#include "globals.h"
+#include "merchants.h"
+#include "wal.h"
+
+// A snapshot is a compact binary image of every account, taken at a point
+// where the write-ahead log is cut cleanly: every change before it is in the
+// image and every change after it is in the log past wal_offset. Restarting
+// maps the image and replays only that tail of the log.
+//
+// Layout, in host byte order like the log:
+//
+//   magic[8] crc[4] reserved[4] wal_offset[8] merchant_count[8]
+//   account_count[8] digest[8] wal_identity[8]
+//   merchant_count times: size[4] name[size]           (ids 0, 1, ...)
+//   account_count times:
+//     id[8] available_limit[8] accepted[8] active_card[1]
+//     time_count[1] times[8 * time_count]               (oldest first)
+//     group_count[4]
+//     group_count times: merchant[4] amount[8]
+//                        time_count[1] times[8 * time_count]
+//
+// crc is the CRC32C of everything after the header followed by the header
+// fields after reserved, so a snapshot can be checksummed as it is
+// streamed out and the counts filled in last. digest is the StateDigest of
+// the accounts, checked again as they are read back. wal_identity is the
+// WalIdentity of the log the snapshot was cut from (0 if none), so that it
+// is never restarted with a log it does not belong to. Expired groups of the
+// similar transactions maps are left out, as lookups no longer see them;
+// the group with the newest time never expires, so a restored map measures
+// expiry from the same newest time.
+const char kSnapshotMagic[8] = {'A', 'U', 'T', 'H', 'S', 'N', 'P', '5'};
+const std::size_t kSnapshotHeaderSize = 8 + 4 + 4 + 8 + 8 + 8 + 8 + 8;
+// Encoded accounts held in memory before SnapshotFile writes them out.
+const std::size_t kSnapshotChunkSize = 1 << 20;
+
+// Encoded accounts of one engine, to be concatenated into a snapshot.
+struct SnapshotPart {
+  std::string bytes;
+  std::uint64_t accounts = 0;
+  // Sum of their AccountDigest.
+  std::uint64_t digest = 0;
+};
+
+template <typename T> void AppendRaw(std::string &out, const T &value) {
+  out.append((const char *)&value, sizeof(value));
+}
+
+template <std::size_t N>
+void AppendTimes(std::string &out, const TimeWindow<N> &window) {
+  static_assert(N < 256, "time counts are stored in one byte");
+  out.push_back((char)window.size());
+  for (std::size_t i = window.size(); i >= 1; --i)
+    AppendRaw(out, window.Back(i));
+}
+
+// Appends every account of engine to part, handing part to spill, which
+// must empty it, whenever it holds kSnapshotChunkSize bytes or more.
+template <typename Spill>
+void AddAccounts(const Engine &engine, SnapshotPart &part, Spill spill) {
+  std::string &out = part.bytes;
+  std::vector<std::uint64_t> merchant_hashes;
+  Merchants().Hashes(merchant_hashes);
+  engine.ForEachAccount([&](std::uint64_t id, const User &user) {
+    AppendRaw(out, id);
+    AppendRaw(out, user.account.available_limit);
+    AppendRaw(out, user.account.accepted);
+    out.push_back(user.account.active_card ? 1 : 0);
+    AppendTimes(out, user.sequentialTransactions);
+    // The group count is only known after the walk.
+    const std::size_t count_at = out.size();
+    std::uint32_t groups = 0;
+    AppendRaw(out, groups);
+    user.specificTransactions.ForEach(
+        [&](const TransactionKey &key,
+            const TimeWindow<kMaxRepetition> &times) {
+          AppendRaw(out, key.merchant);
+          AppendRaw(out, key.amount);
+          AppendTimes(out, times);
+          ++groups;
+        });
+    std::memcpy(&out[count_at], &groups, sizeof(groups));
+    ++part.accounts;
+    part.digest += AccountDigest(id, user, merchant_hashes);
+    if (out.size() >= kSnapshotChunkSize)
+      spill(part);
+  });
+}
+
+// Appends every account of engine to part.
+void AddAccounts(const Engine &engine, SnapshotPart &part) {
+  AddAccounts(engine, part, [](SnapshotPart &) {});
+}
+
+// Writes [data, data + size) to fd, retrying short writes.
+bool WriteAll(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t count = write(fd, data, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+// Where the snapshot for path is written before it is complete.
+std::string SnapshotTemporaryPath(const char *path) {
+  return std::string(path) + ".tmp";
+}
+
+// Renames the complete snapshot for path into place, so path always holds
+// a whole snapshot. The log must already be durable up to its wal_offset.
+bool PublishSnapshot(const char *path) {
+  return rename(SnapshotTemporaryPath(path).c_str(), path) == 0;
+}
+
+// Streams a snapshot to the temporary file of a path: Open writes the
+// merchant dictionary, Add appends accounts, Finish fills in the header and
+// syncs. Accounts never have to fit in memory all at once. The file is
+// removed unless it was finished.
+class SnapshotFile {
+public:
+  explicit SnapshotFile(const char *path)
+      : temporary_(SnapshotTemporaryPath(path)), fd_(-1), error_(0),
+        crc_(0), merchant_count_(0), account_count_(0), digest_(0) {}
+
+  ~SnapshotFile() {
+    if (fd_ >= 0) {
+      close(fd_);
+      unlink(temporary_.c_str());
+    }
+  }
+
+  SnapshotFile(const SnapshotFile &) = delete;
+  SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+  // Creates the file and writes every merchant interned so far. Returns
+  // false and leaves errno set on failure.
+  bool Open() {
+    fd_ = open(temporary_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+      return false;
+    std::string head(kSnapshotHeaderSize, '\0');
+    if (!WriteAll(fd_, head.data(), head.size())) {
+      error_ = errno;
+      return false;
+    }
+    MerchantTable &merchants = Merchants();
+    merchant_count_ = merchants.size();
+    std::string names;
+    for (std::uint64_t id = 0; id < merchant_count_; ++id) {
+      const char *name;
+      std::size_t size;
+      merchants.Name((std::uint32_t)id, name, size);
+      AppendRaw(names, (std::uint32_t)size);
+      names.append(name, size);
+    }
+    Write(names.data(), names.size());
+    return error_ == 0;
+  }
+
+  // Appends the accounts of part.
+  void Add(const SnapshotPart &part) {
+    Write(part.bytes.data(), part.bytes.size());
+    account_count_ += part.accounts;
+    digest_ += part.digest;
+  }
+
+  // Appends every account of engine, a chunk at a time.
+  void Add(const Engine &engine) {
+    SnapshotPart part;
+    auto spill = [this](SnapshotPart &full) {
+      Add(full);
+      full.bytes.clear();
+      full.accounts = 0;
+      full.digest = 0;
+    };
+    AddAccounts(engine, part, spill);
+    spill(part);
+  }
+
+  // Completes the snapshot as cut at wal_offset of the log with
+  // wal_identity and syncs it. Returns false and leaves errno set if
+  // anything so far failed.
+  bool Finish(std::uint64_t wal_offset, std::uint64_t wal_identity) {
+    char head[kSnapshotHeaderSize] = {};
+    std::memcpy(head, kSnapshotMagic, sizeof(kSnapshotMagic));
+    std::memcpy(head + 16, &wal_offset, 8);
+    std::memcpy(head + 24, &merchant_count_, 8);
+    std::memcpy(head + 32, &account_count_, 8);
+    std::memcpy(head + 40, &digest_, 8);
+    std::memcpy(head + 48, &wal_identity, 8);
+    const std::uint32_t crc =
+        Crc32c(head + 16, kSnapshotHeaderSize - 16, crc_);
+    std::memcpy(head + 8, &crc, 4);
+    if (error_ == 0 &&
+        (pwrite(fd_, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+         fsync(fd_) != 0))
+      error_ = errno != 0 ? errno : EIO;
+    if (close(fd_) != 0 && error_ == 0)
+      error_ = errno;
+    fd_ = -1;
+    if (error_ != 0) {
+      unlink(temporary_.c_str());
+      errno = error_;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  void Write(const char *data, std::size_t size) {
+    if (error_ != 0)
+      return;
+    crc_ = Crc32c(data, size, crc_);
+    if (!WriteAll(fd_, data, size))
+      error_ = errno != 0 ? errno : EIO;
+  }
+
+  const std::string temporary_;
+  int fd_;
+  // errno of the first failure, 0 if none.
+  int error_;
+  std::uint32_t crc_;
+  std::uint64_t merchant_count_;
+  std::uint64_t account_count_;
+  std::uint64_t digest_;
+};
+
+// WalIdentity of log, 0 if there is none.
+std::uint64_t IdentityOf(const WriteAheadLog *log) {
+  return log != nullptr ? log->identity() : 0;
+}
+
+// Writes parts[0, count) as a snapshot at wal_offset of the log with
+// wal_identity, together with the merchant dictionary, to a temporary file
+// that is synced and then renamed over path. Returns false and leaves errno
+// set on failure. The log must already be durable up to wal_offset.
+bool WriteSnapshot(const char *path, std::uint64_t wal_offset,
+                   std::uint64_t wal_identity, const SnapshotPart *parts,
+                   std::size_t count) {
+  SnapshotFile file(path);
+  if (!file.Open())
+    return false;
+  for (std::size_t i = 0; i < count; ++i)
+    file.Add(parts[i]);
+  return file.Finish(wal_offset, wal_identity) && PublishSnapshot(path);
+}
+
+// Writes a snapshot of engine to path, cut at the end of log if given. Only
+// for an engine whose thread is the one calling.
+bool WriteSnapshot(const char *path, const Engine &engine,
+                   WriteAheadLog *log) {
+  std::uint64_t wal_offset = 0;
+  if (log != nullptr)
+    wal_offset = log->end_offset();
+  SnapshotFile file(path);
+  if (!file.Open())
+    return false;
+  file.Add(engine);
+  if (!file.Finish(wal_offset, IdentityOf(log)))
+    return false;
+  if (log != nullptr)
+    log->Sync();
+  return PublishSnapshot(path);
+}
+
+// Writes snapshots from a forked child process. fork() gives the child a
+// copy-on-write image of the whole process as of one instant, so the child
+// can encode and write tens of gigabytes of state while the parent goes on
+// changing its own copy; the parent only stops for the fork itself. The
+// child leaves the file under its temporary name, and the parent renames it
+// into place once the child succeeded and the log is durable up to the cut.
+//
+// Only the thread that forks exists in the child, so everything the child
+// reads must be quiescent when Start is called, and it must take no lock
+// another thread could hold at that instant. The merchant table's lock is
+// held across the fork for that reason; the log is never touched by the
+// child.
+class ForkedSnapshot {
+public:
+  ForkedSnapshot() : pid_(-1), log_(nullptr) {}
+
+  // Waits for a running child, publishing its snapshot.
+  ~ForkedSnapshot() { Wait(); }
+
+  ForkedSnapshot(const ForkedSnapshot &) = delete;
+  ForkedSnapshot &operator=(const ForkedSnapshot &) = delete;
+
+  // Whether a child is still writing (or not yet reaped).
+  bool running() const { return pid_ > 0; }
+
+  // Forks a child that calls encode(SnapshotFile &) to add the accounts of
+  // a snapshot for path, cut at the current end of log if given. Whatever
+  // encode reads must not change until Start returns. Returns false and
+  // leaves errno set if no child was started, EBUSY if one still runs.
+  template <typename Encode>
+  bool Start(const char *path, WriteAheadLog *log, Encode encode) {
+    if (running()) {
+      errno = EBUSY;
+      return false;
+    }
+    const std::uint64_t wal_offset = log != nullptr ? log->end_offset() : 0;
+    const std::uint64_t wal_identity = IdentityOf(log);
+    pid_t pid;
+    {
+      std::unique_lock<std::mutex> names = Merchants().Lock();
+      pid = fork();
+    }
+    if (pid < 0)
+      return false;
+    if (pid == 0) {
+      // Exit without running destructors or flushing stdio: those belong
+      // to the parent.
+      SnapshotFile file(path);
+      bool ok = file.Open();
+      if (ok) {
+        encode(file);
+        ok = file.Finish(wal_offset, wal_identity);
+      }
+      _exit(ok ? 0 : errno != 0 ? errno : EIO);
+    }
+    pid_ = pid;
+    path_ = path;
+    log_ = log;
+    return true;
+  }
+
+  // Publishes the snapshot if the child is done; returns at once if not.
+  // Returns false and leaves errno set if the child failed.
+  bool Poll() { return Reap(WNOHANG); }
+
+  // Waits for the child, if any, and publishes its snapshot. Returns false
+  // and leaves errno set if it failed.
+  bool Wait() { return Reap(0); }
+
+private:
+  bool Reap(int options) {
+    if (!running())
+      return true;
+    int status;
+    pid_t done;
+    do {
+      done = waitpid(pid_, &status, options);
+    } while (done < 0 && errno == EINTR);
+    if (done == 0)
+      return true;
+    pid_ = -1;
+    int error = 0;
+    if (done < 0)
+      error = errno;
+    else if (!WIFEXITED(status))
+      error = EINTR;
+    else
+      error = WEXITSTATUS(status);
+    if (error != 0) {
+      unlink(SnapshotTemporaryPath(path_.c_str()).c_str());
+      errno = error;
+      return false;
+    }
+    if (log_ != nullptr)
+      log_->Sync();
+    return PublishSnapshot(path_.c_str());
+  }
+
+  pid_t pid_;
+  std::string path_;
+  WriteAheadLog *log_;
+};
+
+// Maps a snapshot and decodes its accounts one at a time, with merchant ids
+// translated to ids interned in this process.
+class SnapshotReader {
+public:
+  SnapshotReader()
+      : data_(nullptr), size_(0), offset_(0), wal_offset_(0),
+        wal_identity_(0), account_count_(0), accounts_read_(0), digest_(0),
+        digest_read_(0) {}
+
+  ~SnapshotReader() {
+    if (data_ != nullptr)
+      munmap((void *)data_, size_);
+  }
+
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+  // Maps path, checks it and interns its merchants. Returns false and
+  // leaves errno set if it can not be read or is not an intact snapshot.
+  bool Open(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      const int error = errno;
+      close(fd);
+      errno = error;
+      return false;
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return false;
+      }
+      data_ = (const char *)data;
+      madvise(data, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    errno = EINVAL;
+    if (size_ < kSnapshotHeaderSize ||
+        std::memcmp(data_, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0)
+      return false;
+    std::uint32_t crc;
+    std::memcpy(&crc, data_ + 8, 4);
+    const std::uint32_t body_crc = Crc32c(data_ + kSnapshotHeaderSize,
+                                          size_ - kSnapshotHeaderSize);
+    if (Crc32c(data_ + 16, kSnapshotHeaderSize - 16, body_crc) != crc)
+      return false;
+    std::uint64_t merchant_count;
+    std::memcpy(&wal_offset_, data_ + 16, 8);
+    std::memcpy(&merchant_count, data_ + 24, 8);
+    std::memcpy(&account_count_, data_ + 32, 8);
+    std::memcpy(&digest_, data_ + 40, 8);
+    std::memcpy(&wal_identity_, data_ + 48, 8);
+    offset_ = kSnapshotHeaderSize;
+    for (std::uint64_t i = 0; i < merchant_count; ++i) {
+      std::uint32_t size;
+      if (!Read(size) || size > size_ - offset_)
+        return false;
+      merchant_ids_.push_back(InternMerchant(data_ + offset_, size));
+      offset_ += size;
+    }
+    Merchants().Hashes(merchant_hashes_);
+    return true;
+  }
+
+  // Offset of the log where replay has to start.
+  std::uint64_t wal_offset() const { return wal_offset_; }
+
+  // WalIdentity of the log it was cut from, 0 if none.
+  std::uint64_t wal_identity() const { return wal_identity_; }
+
+  std::uint64_t account_count() const { return account_count_; }
+
+  // StateDigest of the accounts when the snapshot was taken.
+  std::uint64_t digest() const { return digest_; }
+
+  // This process' id of every merchant id of the snapshot.
+  const std::vector<std::uint32_t> &merchant_ids() const {
+    return merchant_ids_;
+  }
+
+  // Decodes the next account into id and user and returns true, or returns
+  // false after the last one. error() tells a malformed account apart, and
+  // accounts that do not add up to digest().
+  bool Next(std::uint64_t &id, User &user) {
+    if (accounts_read_ == account_count_) {
+      if (digest_read_ != digest_)
+        return Fail();
+      return false;
+    }
+    long long limit;
+    std::uint64_t accepted;
+    std::uint8_t active;
+    if (!Read(id) || !Read(limit) || !Read(accepted) || !Read(active))
+      return Fail();
+    user = User(active != 0, limit);
+    user.account.accepted = accepted;
+    std::uint8_t times;
+    long long time;
+    if (!Read(times))
+      return Fail();
+    for (std::uint8_t i = 0; i < times; ++i) {
+      if (!Read(time))
+        return Fail();
+      user.sequentialTransactions.Push(time);
+    }
+    std::uint32_t groups;
+    if (!Read(groups))
+      return Fail();
+    for (std::uint32_t group = 0; group < groups; ++group) {
+      TransactionKey key;
+      if (!Read(key.merchant) || !Read(key.amount) || !Read(times) ||
+          key.merchant >= merchant_ids_.size())
+        return Fail();
+      key.merchant = merchant_ids_[key.merchant];
+      for (std::uint8_t i = 0; i < times; ++i) {
+        if (!Read(time))
+          return Fail();
+        user.specificTransactions.Push(key, time);
+      }
+    }
+    ++accounts_read_;
+    digest_read_ += AccountDigest(id, user, merchant_hashes_);
+    return true;
+  }
+
+  bool error() const { return error_; }
+
+private:
+  template <typename T> bool Read(T &value) {
+    if (sizeof(value) > size_ - offset_)
+      return false;
+    std::memcpy(&value, data_ + offset_, sizeof(value));
+    offset_ += sizeof(value);
+    return true;
+  }
+
+  bool Fail() {
+    error_ = true;
+    return false;
+  }
+
+  const char *data_;
+  std::size_t size_;
+  std::size_t offset_;
+  std::uint64_t wal_offset_;
+  std::uint64_t wal_identity_;
+  std::uint64_t account_count_;
+  std::uint64_t accounts_read_;
+  std::uint64_t digest_;
+  std::uint64_t digest_read_;
+  std::vector<std::uint32_t> merchant_ids_;
+  std::vector<std::uint64_t> merchant_hashes_;
+  bool error_ = false;
+};
+
+#endif
@@ -2,96 +2,153 @@
 #define utils_h
 
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <ctime>
 #include <iostream>
-#include <sstream>
+#include <limits>
 #include <stdexcept>
-#include <stdio.h>
 #include <string>
 #include <vector>
 
-#include "json.hpp"
-
 #include "globals.h"
+#include "iso8601.h"
+#include "merchants.h"
+#include "parser.h"
 
 // Converts error enum into corresponding violation message.
 std::string ErrorToViolation(GenericErrors error) {
-  switch (error) {
-  case kOk:
-    return kOkMessage;
-  case kAccountAlreadyInitialized:
-    return kAccountAlreadyInitializedMessage;
-  case kAccountNotInitialized:
-    return kAccountNotInitializedMessage;
-  case kCardNotActive:
-    return kCardNotActiveMessage;
-  case kInsufficientLimit:
-    return kInsufficientLimitMessage;
-  case kHighFrequencySmallInterval:
-    return kHighFrequencySmallIntervalMessage;
-  case kDoubledTransaction:
-    return kDoubledTransactionMessage;
-  default:
+  if (error < 0 || (std::size_t)error >= kViolationCount)
     return kDefaultViolationMessage;
-  }
+  return kViolationNames[error];
 };
 
-// Parses ISO8601 from string format and returns a time_t.
-// Assumes date is always in the same format like "2019-02-13T10:00:00.000Z".
-// Caveat: based on *nix time. Must support this format.
+// Parses ISO8601 from string format and returns a time_t in whole seconds.
+// Accepts the forms handled by ParseISO8601 in iso8601.h, like
+// "2019-02-13T10:00:00.000Z" or "1997-08-14T01:24:21+00:00". Returns -1 (same
+// as timegm) if dateStr is malformed.
 std::time_t ParseISO8601(const std::string &dateStr) {
-  int y, M, d, h, m;
-  float s;
-  sscanf(dateStr.c_str(), "%d-%d-%dT%d:%d:%fZ", &y, &M, &d, &h, &m, &s);
-  tm time;
-  time.tm_year = y - 1900;
-  time.tm_mon = M - 1;
-  time.tm_mday = d;
-  time.tm_hour = h;
-  time.tm_min = m;
-  time.tm_sec = (int)s;
-  return timegm(&time);
+  long long epoch_ms;
+  if (!ParseISO8601(dateStr.data(), dateStr.size(), epoch_ms))
+    return -1;
+  // Floor so that times before the epoch round towards the past.
+  return epoch_ms >= 0 ? epoch_ms / 1000 : -((999 - epoch_ms) / 1000);
+}
+
+// Maps a merchant name to its dense 32-bit id in Merchants(), so history
+// records and keys never hold the string itself. Safe to call from several
+// threads, and lock free for names seen before.
+std::uint32_t InternMerchant(const char *data, std::size_t size) {
+  return Merchants().Intern(data, size);
+}
+
+std::uint32_t InternMerchant(const std::string &merchant) {
+  return InternMerchant(merchant.data(), merchant.size());
 }
 
-// Firstly verifies if window is filled by calculating lower_limit_idx. Then
-// verifies that given the last kMaxFrequency, kFrequencyWindow has not passed
-// (meaning it violates business rules).
-bool IsTransactionFrequent(const std::vector<nlohmann::json> &txn,
-                           const nlohmann::json incoming_transaction,
-                           const int window = kFrequencyWindow,
+// Converts a decoded transaction message into the record used by the rules.
+// The time string is parsed once here, to milliseconds, instead of on every
+// later check. Returns false if the time is malformed.
+bool ToTransaction(const TransactionMessage &message, Transaction &txn) {
+  txn.amount = message.amount;
+  txn.merchant = InternMerchant(message.merchant.data, message.merchant.size);
+  txn.account = message.account_id;
+  return ParseISO8601(message.time.data, message.time.size, txn.time);
+}
+
+// Returns the key used to group similar transactions.
+TransactionKey KeyOf(const Transaction &txn) {
+  TransactionKey key;
+  key.merchant = txn.merchant;
+  key.amount = txn.amount;
+  return key;
+}
+
+// Firstly verifies if window is filled by comparing its size with allowed.
+// Then verifies that given the last allowed transactions, window has not passed
+// (meaning it violates business rules). allowed must not exceed N since older
+// times are no longer kept.
+template <std::size_t N>
+bool IsTransactionFrequent(const TimeWindow<N> &txn,
+                           const Transaction &incoming_transaction,
+                           const long long window = kFrequencyWindow,
                            const int allowed = kMaxFrequency) {
-  const int lower_limit_idx = txn.size() - allowed;
+  assert(allowed > 0 && (std::size_t)allowed <= N);
 
   // If not enough transactions incoming transaction will always be acceptable.
-  if (lower_limit_idx < 0)
+  if (txn.size() < (std::size_t)allowed)
     return false;
 
-  const long long incoming_time_unix =
-      ParseISO8601(incoming_transaction["time"]);
-  const long long lower_limit_unix = ParseISO8601(txn[lower_limit_idx]["time"]);
-  return (incoming_time_unix - lower_limit_unix) < window;
+  return (incoming_transaction.time - txn.Back(allowed)) < window;
 }
 
-// Hashes incoming transaction to make a uuid and verifies using
-// IsTransactionFrequent function and the datastructure specificTransactions
-// whether or not incoming transaction violates business rules.
-bool IsTransactionSimilar(
-    const std::unordered_map<std::string, std::vector<nlohmann::json>>
-        map_by_txn,
-    const nlohmann::json incoming_transaction,
-    const int window = kRepeatedWindow, const int allowed = kMaxRepetition) {
-  // Check if hash of incoming_transaction is present in txn.
-  std::stringstream ss;
-  for (const auto &el : incoming_transaction.items()) {
-    if (el.key() != "time") {
-      ss << el.key() << ":" << el.value() << ":";
-    }
-  }
-  if (map_by_txn.count(ss.str())) {
-    return IsTransactionFrequent(map_by_txn.at(ss.str()), incoming_transaction,
-                                 window, allowed);
+// Looks up the transactions sharing the key of incoming transaction and
+// verifies using IsTransactionFrequent function and the datastructure
+// specificTransactions whether or not incoming transaction violates business
+// rules. window must not exceed the window of map_by_txn, after which its
+// groups expire.
+template <std::size_t N>
+bool IsTransactionSimilar(const WindowsByKey<N> &map_by_txn,
+                          const Transaction &incoming_transaction,
+                          const long long window = kRepeatedWindow,
+                          const int allowed = kMaxRepetition) {
+  assert(window <= map_by_txn.window());
+
+  // A late transaction may repeat a group that has expired already, so it
+  // can not be cleared and is taken for a repeat.
+  if (map_by_txn.IsLate(incoming_transaction.time))
+    return true;
+
+  const TimeWindow<N> *similar = map_by_txn.Find(KeyOf(incoming_transaction));
+  if (similar != nullptr) {
+    return IsTransactionFrequent(*similar, incoming_transaction, window,
+                                 allowed);
   }
   return false;
 }
 
+// Runs every transaction rule for user against incoming transaction, in
+// output order, and returns the violations raised. user is not modified.
+Violations CheckTransaction(const User &user,
+                            const Transaction &incoming_transaction) {
+  Violations violations = kNoViolations;
+
+  // If user card is not active.
+  if (!user.account.active_card)
+    violations |= ViolationBit(kCardNotActive);
+
+  // If not enough funds in account.
+  if (user.account.available_limit < incoming_transaction.amount)
+    violations |= ViolationBit(kInsufficientLimit);
+
+  // If too frequent.
+  if (IsTransactionFrequent(user.sequentialTransactions, incoming_transaction))
+    violations |= ViolationBit(kHighFrequencySmallInterval);
+
+  // If duplicate.
+  if (IsTransactionSimilar(user.specificTransactions, incoming_transaction))
+    violations |= ViolationBit(kDoubledTransaction);
+
+  return violations;
+}
+
+// Records an accepted transaction in user history and charges its amount.
+void ApplyTransaction(User &user, const Transaction &incoming_transaction) {
+  // Add transactions to user profile.
+  user.sequentialTransactions.Push(incoming_transaction.time);
+
+  // Add transaction to transaction-specific data structure.
+  user.specificTransactions.Push(KeyOf(incoming_transaction),
+                                 incoming_transaction.time);
+
+  // Update account balance to user. The limit covers the amount, so the
+  // only way to overflow is a negative amount pushing the limit past the
+  // largest value, where it stays.
+  if (__builtin_sub_overflow(user.account.available_limit,
+                             incoming_transaction.amount,
+                             &user.account.available_limit))
+    user.account.available_limit = std::numeric_limits<long long>::max();
+  ++user.account.accepted;
+}
+
 #endif
\ No newline at end of file
@@ -1,12 +1,177 @@
 #define CATCH_CONFIG_MAIN
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "catch.hpp"
 #include "json.hpp"
 
+#include "accounts.h"
+#include "arena.h"
+#include "balance.h"
+#include "digest.h"
+#include "engine.h"
 #include "globals.h"
+#include "merchants.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "queue.h"
+#include "reader.h"
+#include "recovery.h"
+#include "reorder.h"
+#include "shards.h"
+#include "snapshot.h"
 #include "utils.h"
+#include "wal.h"
+#include "writer.h"
+
+// Copy of a decoded string, for comparisons.
+std::string Text(const TextView &view) {
+  return std::string(view.data, view.size);
+}
+
+// Builds a Transaction record from the same fields the json fixtures used.
+// A malformed time is kept as -1, like ParseISO8601 reports it.
+Transaction MakeTransaction(const std::string &merchant, long long amount,
+                            const std::string &time) {
+  TransactionMessage message;
+  message.merchant.data = merchant.data();
+  message.merchant.size = merchant.size();
+  message.amount = amount;
+  message.time.data = time.data();
+  message.time.size = time.size();
+  Transaction txn = {-1, 0, 0, 0};
+  ToTransaction(message, txn);
+  return txn;
+}
+
+// Deterministic mix of account creations (some repeated) and transactions
+// over account_count accounts, with a few unknown accounts, bursts and
+// repeated merchant/amount pairs so every rule fires somewhere.
+std::vector<Command> MakeWorkload(std::size_t count,
+                                  std::size_t account_count) {
+  std::vector<Command> commands;
+  std::uint64_t state = 88172645463325252ULL;
+  long long time = 1550052000000LL;
+  for (std::size_t i = 0; i < count; ++i) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    Command command;
+    const std::uint64_t account = state % (account_count + 2);
+    if (i < account_count || state % 50 == 0) {
+      command.type = kAccountMessage;
+      command.account.id = i < account_count ? i : account;
+      command.account.active_card = state % 7 != 0;
+      command.account.available_limit = (long long)(state % 1000);
+    } else {
+      command.type = kTransactionMessage;
+      time += (long long)(state % 20000);
+      command.transaction.time = time;
+      command.transaction.amount = (long long)(state >> 20) % 40;
+      command.transaction.merchant = (unsigned int)(state >> 40) % 4;
+      command.transaction.account = account;
+    }
+    commands.push_back(command);
+  }
+  return commands;
+}
+
+// Responses of a single Engine to commands, as text.
+std::string RunSequential(const std::vector<Command> &commands) {
+  Engine engine;
+  ResponseWriter writer;
+  Response response;
+  for (const auto &command : commands) {
+    engine.Handle(command, response);
+    writer.AppendResponse(response);
+  }
+  return writer.buffer();
+}
+
+// Input lines for the same kind of traffic as MakeWorkload, as JSON text,
+// with a few lines that get no response mixed in.
+std::vector<std::string> MakeInputLines(std::size_t count,
+                                        std::size_t account_count) {
+  const char *merchants[] = {"Burger King", "Habbib's", "Uber Eats", "Nike"};
+  std::vector<std::string> lines;
+  for (const auto &command : MakeWorkload(count, account_count)) {
+    std::ostringstream line;
+    if (command.type == kAccountMessage) {
+      line << "{\"account\": {\"account-id\": " << command.account.id
+           << ", \"active-card\": "
+           << (command.account.active_card ? "true" : "false")
+           << ", \"available-limit\": " << command.account.available_limit
+           << "}}";
+    } else {
+      const std::time_t seconds = command.transaction.time / 1000;
+      char time[32];
+      std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S",
+                    std::gmtime(&seconds));
+      line << "{\"transaction\": {\"account-id\": "
+           << command.transaction.account << ", \"merchant\": \""
+           << merchants[command.transaction.merchant] << "\", \"amount\": "
+           << command.transaction.amount << ", \"time\": \"" << time << "."
+           << command.transaction.time % 1000 / 100
+           << command.transaction.time % 100 / 10
+           << command.transaction.time % 10 << "Z\"}}";
+    }
+    lines.push_back(line.str());
+    if (lines.size() % 97 == 0)
+      lines.push_back("not json");
+    if (lines.size() % 89 == 0)
+      lines.push_back("{\"refund\": {\"amount\": 10}}");
+  }
+  return lines;
+}
+
+// Hands out the lines of a vector, like LineReader does for a stream.
+class VectorLineReader {
+public:
+  explicit VectorLineReader(const std::vector<std::string> &lines)
+      : lines_(lines), next_(0) {}
+
+  bool NextLine(LineView &line) {
+    if (next_ == lines_.size())
+      return false;
+    line.data = lines_[next_].data();
+    line.size = lines_[next_].size();
+    ++next_;
+    return true;
+  }
+
+  int error() const { return 0; }
+
+private:
+  const std::vector<std::string> &lines_;
+  std::size_t next_;
+};
+
+// Pushes the times of txns into a window, oldest first.
+template <std::size_t N>
+TimeWindow<N> MakeWindow(const std::vector<Transaction> &txns) {
+  TimeWindow<N> window;
+  for (const auto &txn : txns)
+    window.Push(txn.time);
+  return window;
+}
 
 TEST_CASE("ErrorToViolation") {
   SECTION("Make sure each enum has the corresponding correct message") {
@@ -43,167 +208,345 @@ TEST_CASE("ParseISO8601") {
     REQUIRE((unsigned long long)ParseISO8601(standardIso3) == standardUnix3);
     REQUIRE((unsigned long long)ParseISO8601(standardIso4) == standardUnix4);
   }
+
+  SECTION("Parsing milliseconds, offsets and calendar edges") {
+    long long epoch_ms = 0;
+    const std::string millis = "2019-02-13T10:00:00.123Z";
+    const std::string lower_z = "2019-02-13T10:00:00.1z";
+    const std::string east = "2019-02-13T12:00:00+02:00";
+    const std::string west = "2019-02-13T05:00:00-05:00";
+    const std::string leap_day = "2020-02-29T00:00:00Z";
+    const std::string before_epoch = "1969-12-31T23:59:59.500Z";
+
+    REQUIRE(ParseISO8601(millis.data(), millis.size(), epoch_ms));
+    REQUIRE(epoch_ms == 1550052000123LL);
+    REQUIRE(ParseISO8601(lower_z.data(), lower_z.size(), epoch_ms));
+    REQUIRE(epoch_ms == 1550052000100LL);
+    REQUIRE(ParseISO8601(east.data(), east.size(), epoch_ms));
+    REQUIRE(epoch_ms == 1550052000000LL);
+    REQUIRE(ParseISO8601(west.data(), west.size(), epoch_ms));
+    REQUIRE(epoch_ms == 1550052000000LL);
+    REQUIRE(ParseISO8601(leap_day.data(), leap_day.size(), epoch_ms));
+    REQUIRE(epoch_ms == 1582934400000LL);
+    REQUIRE(ParseISO8601(before_epoch.data(), before_epoch.size(), epoch_ms));
+    REQUIRE(epoch_ms == -500);
+    REQUIRE((unsigned long long)ParseISO8601(standardIso5) == 1578877333);
+  }
+
+  SECTION("Malformed datetimes are reported instead of guessed") {
+    const std::string malformed[] = {
+        "",
+        "garbage",
+        "2019-02-13T10:00:00",
+        "2019-02-13 10:00:00Z",
+        "2019-02-13T10:00:00.Z",
+        "2019-02-13T10:00:00Zx",
+        "2019-02-30T10:00:00Z",
+        "2019-13-01T10:00:00Z",
+        "2019-02-13T24:00:00Z",
+        "2019-02-13T10:00:00+0200",
+        "2008-06-10T18:55:277000z",
+    };
+    for (const auto &date : malformed) {
+      long long epoch_ms = 42;
+      REQUIRE(ParseISO8601(date.data(), date.size(), epoch_ms) == false);
+      REQUIRE(epoch_ms == 42);
+      REQUIRE(ParseISO8601(date) == -1);
+    }
+  }
+
+#if defined(__SSE2__)
+  SECTION("Vectorized and scalar prefix parsing agree") {
+    const std::string prefixes[] = {
+        "2019-02-13T10:00", "1997-08-14t01:24", "0001-01-01T00:00",
+        "2019-02-13X10:00", "2019-0a-13T10:00", "2019/02/13T10:00",
+    };
+    for (const auto &prefix : prefixes) {
+      DateTimePrefix scalar = {0, 0, 0, 0, 0};
+      DateTimePrefix vector = {0, 0, 0, 0, 0};
+      const bool scalar_ok = ParseDateTimePrefixScalar(prefix.data(), scalar);
+      REQUIRE(ParseDateTimePrefixSse2(prefix.data(), vector) == scalar_ok);
+      if (scalar_ok) {
+        REQUIRE(vector.year == scalar.year);
+        REQUIRE(vector.month == scalar.month);
+        REQUIRE(vector.day == scalar.day);
+        REQUIRE(vector.hour == scalar.hour);
+        REQUIRE(vector.minute == scalar.minute);
+      }
+    }
+  }
+#endif
+}
+
+TEST_CASE("InternMerchant") {
+  SECTION("Same name maps to the same id and different names do not") {
+    const unsigned int burger_king = InternMerchant("Burger King");
+    REQUIRE(InternMerchant("Burger King") == burger_king);
+    REQUIRE(InternMerchant("Habbib's") != burger_king);
+  }
+}
+
+TEST_CASE("MerchantTable") {
+  MerchantTable table;
+
+  SECTION("Ids are dense, in order of first appearance") {
+    std::uint32_t id = 0;
+    REQUIRE(table.Find("a", 1, id) == false);
+    REQUIRE(table.Intern("a", 1) == 0);
+    REQUIRE(table.Intern("", 0) == 1);
+    REQUIRE(table.Intern("a", 1) == 0);
+    REQUIRE(table.Find("", 0, id));
+    REQUIRE(id == 1);
+    REQUIRE(table.size() == 2);
+  }
+
+  SECTION("Names survive the table growing") {
+    const std::size_t count = 5 * MerchantTable::kInitialCapacity;
+    for (std::size_t i = 0; i < count; ++i) {
+      const std::string name = "merchant " + std::to_string(i);
+      REQUIRE(table.Intern(name.data(), name.size()) == i);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+      const std::string name = "merchant " + std::to_string(i);
+      std::uint32_t id = 0;
+      REQUIRE(table.Find(name.data(), name.size(), id));
+      REQUIRE(id == i);
+      const char *data;
+      std::size_t size;
+      table.Name(id, data, size);
+      REQUIRE(std::string(data, size) == name);
+    }
+  }
+
+  SECTION("Threads interning the same names agree on their ids") {
+    const std::size_t count = 3000;
+    std::vector<std::vector<std::uint32_t>> ids(4);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < ids.size(); ++t) {
+      threads.emplace_back([&table, &ids, t, count] {
+        for (std::size_t i = 0; i < count; ++i) {
+          // Each thread walks the names in a different order.
+          const std::size_t n = (i * (2 * t + 1)) % count;
+          const std::string name = std::to_string(n);
+          ids[t].push_back(table.Intern(name.data(), name.size()));
+        }
+      });
+    }
+    for (auto &thread : threads)
+      thread.join();
+    REQUIRE(table.size() == count);
+    for (std::size_t t = 0; t < ids.size(); ++t) {
+      for (std::size_t i = 0; i < count; ++i) {
+        const std::string name = std::to_string((i * (2 * t + 1)) % count);
+        std::uint32_t id = 0;
+        REQUIRE(table.Find(name.data(), name.size(), id));
+        REQUIRE(ids[t][i] == id);
+      }
+    }
+  }
+}
+
+TEST_CASE("TimeWindow") {
+  SECTION("Only the last N timestamps are kept") {
+    TimeWindow<3> window;
+    REQUIRE(window.empty());
+    for (long long time = 1; time <= 5; ++time)
+      window.Push(time);
+    REQUIRE(window.size() == 3);
+    REQUIRE(window.Back(1) == 5);
+    REQUIRE(window.Back(2) == 4);
+    REQUIRE(window.Back(3) == 3);
+  }
+}
+
+TEST_CASE("WindowMap") {
+  const TransactionKey key_a = {InternMerchant("a"), 10};
+  const TransactionKey key_b = {InternMerchant("b"), 10};
+
+  SECTION("Windows are kept per key") {
+    TransactionsByKey map_txn(kRepeatedWindow);
+    map_txn.Push(key_a, 100);
+    REQUIRE(map_txn.Find(key_a) != nullptr);
+    REQUIRE(map_txn.Find(key_a)->Back(1) == 100);
+    REQUIRE(map_txn.Find(key_b) == nullptr);
+  }
+
+  SECTION("Keys expire two windows after their last time and their slots "
+          "are reused") {
+    const long long window = kRepeatedWindow;
+    TransactionsByKey map_txn(kRepeatedWindow);
+    for (long long i = 0; i < 1000; ++i) {
+      const TransactionKey key = {(unsigned int)i, i};
+      map_txn.Push(key, i * window);
+    }
+    // Only the last two keys are within two windows of the newest time.
+    const TransactionKey newest = {999, 999};
+    const TransactionKey previous = {998, 998};
+    const TransactionKey expired = {997, 997};
+    REQUIRE(map_txn.Find(newest) != nullptr);
+    REQUIRE(map_txn.Find(previous) != nullptr);
+    REQUIRE(map_txn.Find(expired) == nullptr);
+    REQUIRE(map_txn.capacity() == 8);
+  }
+
+  SECTION("An expired key is gone before its slot is reclaimed") {
+    const long long window = kRepeatedWindow;
+    TransactionsByKey map_txn(kRepeatedWindow);
+    map_txn.Push(key_a, 0);
+    map_txn.Push(key_b, 2 * window - 1);
+    REQUIRE(map_txn.Find(key_a) != nullptr);
+    // Times going backwards leave the newest time, and key_a, alone.
+    map_txn.Push(key_b, window);
+    REQUIRE(map_txn.Find(key_a) != nullptr);
+    map_txn.Push(key_b, 2 * window);
+    REQUIRE(map_txn.Find(key_a) == nullptr);
+    REQUIRE(map_txn.size() == 2);
+    int live = 0;
+    map_txn.ForEach([&](const TransactionKey &, const TimeWindow<1> &) {
+      ++live;
+    });
+    REQUIRE(live == 1);
+
+    // Pushing it again starts a new group.
+    map_txn.Push(key_a, 2 * window);
+    REQUIRE(map_txn.Find(key_a) != nullptr);
+    REQUIRE(map_txn.Find(key_a)->size() == 1);
+    REQUIRE(map_txn.size() == 2);
+  }
+
+  SECTION("Times before the horizon are late") {
+    const long long window = kRepeatedWindow;
+    TransactionsByKey map_txn(kRepeatedWindow);
+    REQUIRE(map_txn.IsLate(LLONG_MIN) == false);
+    map_txn.Push(key_a, 10 * window);
+    REQUIRE(map_txn.IsLate(9 * window) == false);
+    REQUIRE(map_txn.IsLate(9 * window - 1) == true);
+    // A late push does not move the horizon back.
+    map_txn.Push(key_b, 0);
+    REQUIRE(map_txn.IsLate(9 * window - 1) == true);
+  }
 }
 
 TEST_CASE("IsTransactionFrequent") {
   // Create test vector with base transactions.
-  std::vector<nlohmann::json> small_transactions{
-      {
-          {"merchant", "a"},
-          {"amount", 10},
-          {"time", "2008-06-10T18:55:24.000z"},
-      },
+  std::vector<Transaction> small_transactions{
+      MakeTransaction("a", 10, "2008-06-10T18:55:24.000z"),
   };
 
-  std::vector<nlohmann::json> big_transactions{
-      {
-          {"merchant", "a"},
-          {"amount", 10},
-          {"time", "2008-06-10T18:55:24.000z"},
-      },
-      {
-          {"merchant", "b"},
-          {"amount", 20},
-          {"time", "2008-06-10T18:55:26.000z"},
-      },
-      {
-          {"merchant", "c"},
-          {"amount", 20},
-          {"time", "2008-06-10T18:55:26.000z"},
-      },
+  std::vector<Transaction> big_transactions{
+      MakeTransaction("a", 10, "2008-06-10T18:55:24.000z"),
+      MakeTransaction("b", 20, "2008-06-10T18:55:26.000z"),
+      MakeTransaction("c", 20, "2008-06-10T18:55:26.000z"),
   };
 
+  // Keep only the times the rule looks back at, same as User does.
+  const TimeWindow<kMaxFrequency> small_window =
+      MakeWindow<kMaxFrequency>(small_transactions);
+  const TimeWindow<kMaxFrequency> big_window =
+      MakeWindow<kMaxFrequency>(big_transactions);
+
   SECTION("Checking for frequent transactions when transaction vector size is "
           "less than kMaxFrequency") {
-    nlohmann::json random_incoming_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:30.000Z"},
-    };
-    nlohmann::json window_edge_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:31.000Z"},
-    };
+    const Transaction random_incoming_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:30.000Z");
+    const Transaction window_edge_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:31.000Z");
 
     // Incoming transaction is inside the 2 minute window but there are only 2
     // transactions. Must return false.
-    REQUIRE(IsTransactionFrequent(small_transactions,
+    REQUIRE(IsTransactionFrequent(small_window,
                                   random_incoming_transaction) == false);
     // Incoming transaction is on the edge of the 2 minute window but there are
     // only 2 transactions. Must return false.
-    REQUIRE(IsTransactionFrequent(small_transactions,
+    REQUIRE(IsTransactionFrequent(small_window,
                                   window_edge_transaction) == false);
   }
 
   SECTION("Checking for frequent transactions based on basic examples with "
           "default parameters") {
-    nlohmann::json before_window_edge_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:57:23.000Z"},
-    };
-    nlohmann::json window_edge_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:57:24.000Z"},
-    };
-    nlohmann::json after_window_edge_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:57:25.000Z"},
-    };
+    const Transaction before_window_edge_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:57:23.000Z");
+    const Transaction window_edge_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:57:24.000Z");
+    const Transaction after_window_edge_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:57:25.000Z");
 
     // Incoming transaction is the 4th inside the 2 minute window. Must return
     // true.
-    REQUIRE(IsTransactionFrequent(big_transactions,
+    REQUIRE(IsTransactionFrequent(big_window,
                                   before_window_edge_transaction) == true);
     // Incoming transaction is the 4th on the edge of the 2 minute window. Must
     // return false since it is 2 min inclusive.
-    REQUIRE(IsTransactionFrequent(big_transactions, window_edge_transaction) ==
+    REQUIRE(IsTransactionFrequent(big_window, window_edge_transaction) ==
             false);
     // Incoming transaction is the 4th outside of the 2 minute window. Must
     // return false.
-    REQUIRE(IsTransactionFrequent(big_transactions,
+    REQUIRE(IsTransactionFrequent(big_window,
                                   after_window_edge_transaction) == false);
   }
 
   SECTION("Checking for frequent transactions based on basic examples with "
           "custom parameters") {
-    nlohmann::json before_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:25.000Z"},
-    };
-    nlohmann::json on_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:34.000Z"},
-    };
-    nlohmann::json after_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:35.000Z"},
-    };
+    const Transaction before_window_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:25.000Z");
+    const Transaction on_window_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:34.000Z");
+    const Transaction after_window_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:35.000Z");
 
     // Create a frequency of 1 transaction every 10 seconds. (Rate-limit)
-    const int kWindow = 10;
+    const long long kWindow = 10 * 1000;
     const int kMaxFrequency = 1;
 
     // Incoming transaction is the 2nd inside the 10 second window where limit
     // is 1. Must return true.
-    REQUIRE(IsTransactionFrequent(small_transactions, before_window_transaction,
+    REQUIRE(IsTransactionFrequent(small_window, before_window_transaction,
                                   kWindow, kMaxFrequency) == true);
     // Incoming transaction is the 2nd on the 10 second window where limit is 1.
     // Must return false.
-    REQUIRE(IsTransactionFrequent(small_transactions, on_window_transaction,
+    REQUIRE(IsTransactionFrequent(small_window, on_window_transaction,
                                   kWindow, kMaxFrequency) == false);
     // Incoming transaction is the 2nd after the 10 second window where limit
     // is 1. Must return false.
-    REQUIRE(IsTransactionFrequent(small_transactions, after_window_transaction,
+    REQUIRE(IsTransactionFrequent(small_window, after_window_transaction,
                                   kWindow, kMaxFrequency) == false);
   }
+
+  SECTION("Checking for frequent transactions inside the same second") {
+    const TimeWindow<1> burst =
+        MakeWindow<1>({MakeTransaction("c", 10, "2008-06-10T18:55:24.100Z")});
+    const Transaction same_second =
+        MakeTransaction("c", 10, "2008-06-10T18:55:24.900Z");
+    const Transaction on_window =
+        MakeTransaction("c", 10, "2008-06-10T18:55:25.100Z");
+
+    // One transaction per second. Times are compared in milliseconds so both
+    // ends of the window are exact.
+    REQUIRE(IsTransactionFrequent(burst, same_second, 1000, 1) == true);
+    REQUIRE(IsTransactionFrequent(burst, on_window, 1000, 1) == false);
+  }
 }
 
 TEST_CASE("IsTransactionSimilar") {
   // Create test vector with base transactions.
-  std::vector<nlohmann::json> no_transactions{};
+  std::vector<Transaction> no_transactions{};
 
-  std::vector<nlohmann::json> small_transactions{
-      {
-          {"merchant", "a"},
-          {"amount", 20},
-          {"time", "2008-06-10T18:55:26.000z"},
-      },
+  std::vector<Transaction> small_transactions{
+      MakeTransaction("a", 20, "2008-06-10T18:55:26.000z"),
   };
 
-  std::vector<nlohmann::json> big_transactions{
-      {
-          {"merchant", "a"},
-          {"amount", 10},
-          {"time", "2008-06-10T18:55:24.000z"},
-      },
-      {
-          {"merchant", "c"},
-          {"amount", 20},
-          {"time", "2008-06-10T18:55:26.000z"},
-      },
-      {
-          {"merchant", "c"},
-          {"amount", 20},
-          {"time", "2008-06-10T18:55:277000z"},
-      },
+  std::vector<Transaction> big_transactions{
+      MakeTransaction("a", 10, "2008-06-10T18:55:24.000z"),
+      MakeTransaction("c", 20, "2008-06-10T18:55:26.000z"),
+      MakeTransaction("c", 20, "2008-06-10T18:55:277000z"),
   };
 
   SECTION("Checking for repeated transactions when transaction vector size is "
           "less than kMaxRepetition") {
-    nlohmann::json random_incoming_transaction = {
-        {"merchant", "c"},
-        {"amount", 10},
-        {"time", "2008-06-10T18:55:30.000Z"},
-    };
+    const Transaction random_incoming_transaction =
+        MakeTransaction("c", 10, "2008-06-10T18:55:30.000Z");
 
-    std::unordered_map<std::string, std::vector<nlohmann::json>> map_txn;
+    TransactionsByKey map_txn(kRepeatedWindow);
 
     // Incoming transaction handles when kMaxRepetition (1) is greater than
     // transactions.size().
@@ -214,35 +557,17 @@ TEST_CASE("IsTransactionSimilar") {
   SECTION("Checking for repeated transactions using business rules and common "
           "examples") {
     // Create map from the transactions within small_transactions.
-    std::unordered_map<std::string, std::vector<nlohmann::json>> map_txn;
-    std::stringstream ss;
-    for (int i = 0; i < small_transactions.size(); ++i) {
-      for (const auto &el : small_transactions[i].items()) {
-        if (el.key() != "time") {
-          ss << el.key() << ":" << el.value() << ":";
-        }
-      }
-      map_txn[ss.str()].push_back(small_transactions[i]);
-      ss.str(std::string());
+    TransactionsByKey map_txn(kRepeatedWindow);
+    for (const auto &txn : small_transactions) {
+      map_txn.Push(KeyOf(txn), txn.time);
     }
 
-    nlohmann::json before_window_transaction = {
-        {"merchant", "a"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:57:25.000Z"},
-    };
-
-    nlohmann::json on_window_transaction = {
-        {"merchant", "a"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:57:26.000Z"},
-    };
-
-    nlohmann::json after_window_transaction = {
-        {"merchant", "a"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:57:27.000Z"},
-    };
+    const Transaction before_window_transaction =
+        MakeTransaction("a", 20, "2008-06-10T18:57:25.000Z");
+    const Transaction on_window_transaction =
+        MakeTransaction("a", 20, "2008-06-10T18:57:26.000Z");
+    const Transaction after_window_transaction =
+        MakeTransaction("a", 20, "2008-06-10T18:57:27.000Z");
 
     // Incoming transaction is inside the 2 minute window and previous
     // transaction is similar. Must return true.
@@ -255,42 +580,54 @@ TEST_CASE("IsTransactionSimilar") {
     REQUIRE(IsTransactionSimilar(map_txn, after_window_transaction) == false);
   }
 
+  SECTION("A late transaction is taken for a repeat, whatever groups are "
+          "left") {
+    TransactionsByKey map_txn(kRepeatedWindow);
+    const Transaction first = MakeTransaction("a", 20,
+                                              "2008-06-10T18:55:26.000Z");
+    map_txn.Push(KeyOf(first), first.time);
+    // Many later groups, so the table is rebuilt past the first one's slot.
+    for (int i = 0; i < 100; ++i) {
+      const Transaction later = MakeTransaction(
+          "later " + std::to_string(i), 20, "2008-06-10T20:00:00.000Z");
+      map_txn.Push(KeyOf(later), later.time);
+    }
+
+    // The horizon is 19:58:00; the group of first has expired.
+    const Transaction late_repeat = MakeTransaction(
+        "a", 20, "2008-06-10T18:55:30.000Z");
+    REQUIRE(IsTransactionSimilar(map_txn, late_repeat) == true);
+    const Transaction late_other = MakeTransaction(
+        "a", 21, "2008-06-10T19:57:59.999Z");
+    REQUIRE(IsTransactionSimilar(map_txn, late_other) == true);
+    // On the horizon a transaction is judged by the groups left.
+    const Transaction on_horizon = MakeTransaction(
+        "a", 20, "2008-06-10T19:58:00.000Z");
+    REQUIRE(IsTransactionSimilar(map_txn, on_horizon) == false);
+    const Transaction repeat = MakeTransaction(
+        "later 7", 20, "2008-06-10T19:58:00.000Z");
+    REQUIRE(IsTransactionSimilar(map_txn, repeat) == true);
+  }
+
   SECTION("Checking for repeated transactions using custom business rules and "
           "common examples") {
     // Create map from the transactions within big_transactions.
-    std::unordered_map<std::string, std::vector<nlohmann::json>> map_txn;
-    std::stringstream ss;
-    for (int i = 0; i < big_transactions.size(); ++i) {
-      for (const auto &el : big_transactions[i].items()) {
-        if (el.key() != "time") {
-          ss << el.key() << ":" << el.value() << ":";
-        }
-      }
-      map_txn[ss.str()].push_back(big_transactions[i]);
-      ss.str(std::string());
+    // Room for the 2 similar transactions the custom rule looks back at.
+    WindowsByKey<2> map_txn(kRepeatedWindow);
+    for (const auto &txn : big_transactions) {
+      map_txn.Push(KeyOf(txn), txn.time);
     }
 
-    nlohmann::json before_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:55:27.000Z"},
-    };
-
-    nlohmann::json on_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:55:36.000Z"},
-    };
-
-    nlohmann::json after_window_transaction = {
-        {"merchant", "c"},
-        {"amount", 20},
-        {"time", "2008-06-10T18:55:37.000Z"},
-    };
+    const Transaction before_window_transaction =
+        MakeTransaction("c", 20, "2008-06-10T18:55:27.000Z");
+    const Transaction on_window_transaction =
+        MakeTransaction("c", 20, "2008-06-10T18:55:36.000Z");
+    const Transaction after_window_transaction =
+        MakeTransaction("c", 20, "2008-06-10T18:55:37.000Z");
 
     // Create a frequency of 2 similar transaction every 10 seconds.
     // (Rate-limit)
-    const int kWindow = 10;
+    const long long kWindow = 10 * 1000;
     const int kMaxRepetition = 2;
 
     // Incoming transaction is inside the 10 seconds window but there are only 2
@@ -307,3 +644,1384 @@ TEST_CASE("IsTransactionSimilar") {
                                  kMaxRepetition) == false);
   }
 }
+
+TEST_CASE("CheckTransaction") {
+  const Transaction first =
+      MakeTransaction("a", 10, "2019-02-13T10:00:00.000Z");
+  const Transaction repeat =
+      MakeTransaction("a", 10, "2019-02-13T10:00:01.000Z");
+
+  SECTION("Account rules are reported as bits in output order") {
+    const User inactive(false, 5);
+    REQUIRE(CheckTransaction(inactive, first) ==
+            (ViolationBit(kCardNotActive) | ViolationBit(kInsufficientLimit)));
+  }
+
+  SECTION("Accepted transactions feed the history rules") {
+    User user(true, 100);
+    REQUIRE(CheckTransaction(user, first) == kNoViolations);
+    ApplyTransaction(user, first);
+    REQUIRE(user.account.available_limit == 90);
+    REQUIRE(user.account.accepted == 1);
+    REQUIRE(CheckTransaction(user, repeat) ==
+            ViolationBit(kDoubledTransaction));
+  }
+
+  SECTION("Negative amounts cannot wrap the limit around") {
+    User user(true, std::numeric_limits<long long>::max() - 1);
+    ApplyTransaction(user,
+                     MakeTransaction("a", -5, "2019-02-13T10:00:00.000Z"));
+    REQUIRE(user.account.available_limit ==
+            std::numeric_limits<long long>::max());
+  }
+}
+
+TEST_CASE("ParseMessage") {
+  Message message;
+
+  SECTION("Decoding both message shapes from the examples") {
+    const std::string account_line =
+        "{\"account\": {\"active-card\": true, \"available-limit\": 100}}";
+    REQUIRE(ParseMessage(account_line.data(), account_line.size(), message));
+    REQUIRE(message.type == kAccountMessage);
+    REQUIRE(message.account.active_card == true);
+    REQUIRE(message.account.available_limit == 100);
+
+    const std::string transaction_line =
+        "{\"transaction\": {\"merchant\": \"Burger King\", \"amount\": 20, "
+        "\"time\": \"2019-02-13T10:00:00.000Z\"}}";
+    REQUIRE(ParseMessage(transaction_line.data(), transaction_line.size(),
+                         message));
+    REQUIRE(message.type == kTransactionMessage);
+    REQUIRE(Text(message.transaction.merchant) == "Burger King");
+    REQUIRE(message.transaction.amount == 20);
+    REQUIRE(Text(message.transaction.time) == "2019-02-13T10:00:00.000Z");
+  }
+
+  SECTION("Account ids are read from both shapes and default to 0") {
+    const std::string account_line =
+        "{\"account\": {\"account-id\": 18446744073709551615, "
+        "\"active-card\": false, \"available-limit\": 5}}";
+    REQUIRE(ParseMessage(account_line.data(), account_line.size(), message));
+    REQUIRE(message.account.id == 18446744073709551615ULL);
+
+    const std::string transaction_line =
+        "{\"transaction\": {\"account-id\": 42, \"merchant\": \"m\", "
+        "\"amount\": 1, \"time\": \"2019-02-13T10:00:00.000Z\"}}";
+    REQUIRE(ParseMessage(transaction_line.data(), transaction_line.size(),
+                         message));
+    REQUIRE(message.transaction.account_id == 42);
+
+    const std::string legacy_line =
+        "{\"account\": {\"active-card\": true, \"available-limit\": 1}}";
+    REQUIRE(ParseMessage(legacy_line.data(), legacy_line.size(), message));
+    REQUIRE(message.account.id == 0);
+  }
+
+  SECTION("Unknown keys and nested values are skipped") {
+    const std::string line =
+        "{\"transaction\": {\"extra\": {\"amount\": 1}, \"amount\": 5, "
+        "\"tags\": [\"a\", 2], \"merchant\": \"m\", \"time\": \"t\"}}";
+    REQUIRE(ParseMessage(line.data(), line.size(), message));
+    REQUIRE(message.transaction.amount == 5);
+    REQUIRE(Text(message.transaction.merchant) == "m");
+  }
+
+  SECTION("Strings the SAX parser unescapes are kept in the arena") {
+    {
+      const std::string line =
+          "{\"transaction\": {\"merchant\": \"Caf\\u00e9\", \"amount\": 1, "
+          "\"time\": \"2019-02-13T10:00:00.000Z\"}}";
+      REQUIRE(ParseMessage(line.data(), line.size(), message));
+    }
+    REQUIRE(Text(message.transaction.merchant) == "Caf\xc3\xa9");
+    REQUIRE(Text(message.transaction.time) == "2019-02-13T10:00:00.000Z");
+  }
+
+  SECTION("Numbers with an exponent or fraction must be whole and fit") {
+    const std::string whole =
+        "{\"transaction\": {\"account-id\": 2e1, \"amount\": 1e3}}";
+    REQUIRE(ParseMessage(whole.data(), whole.size(), message));
+    REQUIRE(message.transaction.account_id == 20);
+    REQUIRE(message.transaction.amount == 1000);
+
+    const std::vector<std::string> lines = {
+        "{\"account\": {\"available-limit\": 1e300}}",
+        "{\"account\": {\"available-limit\": -1e19}}",
+        "{\"transaction\": {\"amount\": -1.5}}",
+        "{\"transaction\": {\"amount\": 9223372036854775808.0}}",
+        "{\"transaction\": {\"account-id\": -1.0}}",
+        "{\"account\": {\"account-id\": 1.8446744073709552e19}}",
+    };
+    for (const auto &line : lines)
+      REQUIRE(ParseMessage(line.data(), line.size(), message) == false);
+
+    // Fields that are not numbers still ignore them.
+    const std::string other =
+        "{\"transaction\": {\"extra\": 1e300, \"amount\": 1}}";
+    REQUIRE(ParseMessage(other.data(), other.size(), message));
+  }
+
+  SECTION("Malformed lines and unknown shapes are rejected") {
+    const std::string truncated = "{\"account\": {\"active-card\": tr";
+    const std::string unknown = "{\"refund\": {\"amount\": 10}}";
+    REQUIRE(ParseMessage(truncated.data(), truncated.size(), message) ==
+            false);
+    REQUIRE(ParseMessage(unknown.data(), unknown.size(), message) == false);
+  }
+}
+
+TEST_CASE("ScanMessage") {
+  // What MessageSax alone makes of line.
+  auto sax_parse = [](const std::string &line, Message &message) {
+    ResetMessage(message);
+    MessageSax sax(message);
+    return nlohmann::json::sax_parse(
+               nlohmann::detail::input_adapter(line.data(), line.size()),
+               &sax) &&
+           message.type != kUnknownMessage;
+  };
+  auto same = [](const Message &a, const Message &b) {
+    return a.type == b.type && a.account.id == b.account.id &&
+           a.account.active_card == b.account.active_card &&
+           a.account.available_limit == b.account.available_limit &&
+           a.transaction.account_id == b.transaction.account_id &&
+           Text(a.transaction.merchant) == Text(b.transaction.merchant) &&
+           a.transaction.amount == b.transaction.amount &&
+           Text(a.transaction.time) == Text(b.transaction.time);
+  };
+
+  SECTION("Canonical lines take the fast path and match the SAX result") {
+    const std::vector<std::string> lines = {
+        "{\"account\": {\"active-card\": true, \"available-limit\": 100}}",
+        "{\"account\":{\"available-limit\":-5,\"account-id\":7,"
+        "\"active-card\":false}}",
+        " { \"account\" : { } } \r",
+        "{\"transaction\": {\"merchant\": \"Burger King\", \"amount\": 20, "
+        "\"time\": \"2019-02-13T10:00:00.000Z\"}}",
+        "{\"transaction\": {\"account-id\": 999999999999999999, "
+        "\"amount\": -0, \"time\": \"\", \"merchant\": \"a\"}}",
+        "{\"account\": {\"account-id\": -1}}",
+    };
+    for (const auto &line : lines) {
+      Message fast;
+      Message slow;
+      ResetMessage(fast);
+      REQUIRE(ScanMessage(line.data(), line.size(), fast));
+      REQUIRE(sax_parse(line, slow));
+      REQUIRE(same(fast, slow));
+    }
+  }
+
+  SECTION("Anything else is left to the SAX parser") {
+    const std::vector<std::string> lines = {
+        "{\"transaction\": {\"merchant\": \"Caf\\u00e9\", \"amount\": 1}}",
+        "{\"transaction\": {\"merchant\": \"Caf\xc3\xa9\", \"amount\": 1}}",
+        "{\"transaction\": {\"amount\": 1.5}}",
+        "{\"transaction\": {\"amount\": 1e3}}",
+        "{\"transaction\": {\"amount\": 012}}",
+        "{\"transaction\": {\"amount\": 12345678901234567890}}",
+        "{\"transaction\": {\"extra\": 1, \"amount\": 1}}",
+        "{\"transaction\": {\"amount\": \"1\"}}",
+        "{\"account\": {\"active-card\": 1}}",
+        "{\"account\": {}, \"transaction\": {}}",
+        "{\"refund\": {}}",
+        "{\"account\": {\"active-card\": truex}}",
+        "{\"account\": {}} x",
+        "{\"account\": {\"active-card\": true,}}",
+        "",
+    };
+    for (const auto &line : lines) {
+      Message message;
+      ResetMessage(message);
+      REQUIRE(ScanMessage(line.data(), line.size(), message) == false);
+      // ParseMessage still gives the SAX answer.
+      Message slow;
+      const bool valid = sax_parse(line, slow);
+      REQUIRE(ParseMessage(line.data(), line.size(), message) == valid);
+      if (valid)
+        REQUIRE(same(message, slow));
+    }
+  }
+}
+
+TEST_CASE("Arena") {
+  Arena arena(64);
+
+  SECTION("Allocations are aligned and do not overlap") {
+    char *a = arena.Copy("abc", 3);
+    long long *b = (long long *)arena.Allocate(sizeof(long long));
+    *b = -1;
+    REQUIRE((std::uintptr_t)b % alignof(std::max_align_t) == 0);
+    REQUIRE(std::string(a, 3) == "abc");
+    REQUIRE(*b == -1);
+  }
+
+  SECTION("Reset hands the same memory out again") {
+    char *first = arena.Copy("abc", 3);
+    for (int i = 0; i < 10; ++i)
+      arena.Allocate(40);
+    const std::size_t capacity = arena.capacity();
+    arena.Reset();
+    REQUIRE(arena.Copy("xyz", 3) == first);
+    for (int i = 0; i < 10; ++i)
+      arena.Allocate(40);
+    REQUIRE(arena.capacity() == capacity);
+  }
+
+  SECTION("Requests larger than a block get a block of their own") {
+    const std::string big(1000, 'x');
+    char *copy = arena.Copy(big.data(), big.size());
+    REQUIRE(std::string(copy, big.size()) == big);
+    REQUIRE(arena.capacity() >= 1000);
+  }
+}
+
+TEST_CASE("ResponseWriter") {
+  ResponseWriter writer;
+
+  SECTION("Responses match the json dump they replace") {
+    const long long limits[] = {0, 7, 90, 100, 12345678901234LL, -42};
+    for (const long long limit : limits) {
+      for (unsigned int violations = 0; violations < (1u << 7);
+           violations += 5) {
+        nlohmann::json expected;
+        expected["violations"] = std::vector<std::string>();
+        for (int error = kOk; error <= kDoubledTransaction; ++error) {
+          if (violations & (1u << error))
+            expected["violations"].push_back(
+                ErrorToViolation((GenericErrors)error));
+        }
+        expected["account"] = {{"active-card", limit % 2 == 0},
+                               {"available-limit", limit}};
+
+        writer.clear();
+        writer.AppendAccountResponse(0, limit % 2 == 0, limit, violations);
+        REQUIRE(writer.buffer() == expected.dump() + "\n");
+      }
+    }
+  }
+
+  SECTION("Account ids other than 0 are written first") {
+    writer.AppendAccountResponse(7, true, 100, kNoViolations);
+    REQUIRE(writer.buffer() ==
+            "{\"account\":{\"account-id\":7,\"active-card\":true,"
+            "\"available-limit\":100},\"violations\":[]}\n");
+  }
+
+  SECTION("Responses without an account only carry violations") {
+    writer.AppendViolationsResponse(1u << kAccountNotInitialized);
+    REQUIRE(writer.buffer() ==
+            "{\"violations\":[\"account-not-initialized\"]}\n");
+  }
+}
+
+TEST_CASE("FindNewline") {
+  SECTION("Finds the first newline at any offset, like memchr") {
+    std::string text(70, 'x');
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      std::string line = text;
+      line[i] = '\n';
+      line[line.size() - 1] = '\n';
+      const char *end = line.data() + line.size();
+      REQUIRE(FindNewline(line.data(), end) == line.data() + i);
+    }
+    REQUIRE(FindNewline(text.data(), text.data() + text.size()) ==
+            text.data() + text.size());
+  }
+}
+
+TEST_CASE("LineReader") {
+  SECTION("Lines straddling chunks and longer than the buffer are returned "
+          "whole") {
+    const std::string input =
+        "{\"account\": {\"active-card\": true}}\n"
+        "short\n"
+        "\n"
+        "a line that is much longer than the eight byte chunk size\n"
+        "last line without newline";
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    REQUIRE(write(fds[1], input.data(), input.size()) == (ssize_t)input.size());
+    close(fds[1]);
+
+    LineReader reader(fds[0], 8);
+    LineView line;
+    std::vector<std::string> lines;
+    while (reader.NextLine(line))
+      lines.push_back(std::string(line.data, line.size));
+    close(fds[0]);
+
+    REQUIRE(reader.error() == 0);
+    REQUIRE(lines.size() == 5);
+    REQUIRE(lines[0] == "{\"account\": {\"active-card\": true}}");
+    REQUIRE(lines[1] == "short");
+    REQUIRE(lines[2] == "");
+    REQUIRE(lines[3] ==
+            "a line that is much longer than the eight byte chunk size");
+    REQUIRE(lines[4] == "last line without newline");
+  }
+}
+
+TEST_CASE("MappedLineReader") {
+  SECTION("Lines of a file are returned as views into the mapping") {
+    char path[] = "/tmp/authenticator_test_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    const std::string input = "first\n\nthird without newline";
+    REQUIRE(write(fd, input.data(), input.size()) == (ssize_t)input.size());
+    close(fd);
+
+    MappedLineReader reader;
+    REQUIRE(reader.Open(path));
+    LineView line;
+    REQUIRE(reader.NextLine(line));
+    REQUIRE(std::string(line.data, line.size) == "first");
+    REQUIRE(reader.NextLine(line));
+    REQUIRE(line.size == 0);
+    REQUIRE(reader.NextLine(line));
+    REQUIRE(std::string(line.data, line.size) == "third without newline");
+    REQUIRE(reader.NextLine(line) == false);
+    unlink(path);
+  }
+
+  SECTION("Missing files are reported") {
+    MappedLineReader reader;
+    REQUIRE(reader.Open("/nonexistent/operations") == false);
+  }
+
+  SECTION("Anything but a regular file is refused rather than read as empty") {
+    MappedLineReader reader;
+    REQUIRE(reader.Open("/dev/null") == false);
+    REQUIRE(errno == ENODEV);
+  }
+}
+
+TEST_CASE("AccountTable") {
+  const User user(true, 100);
+
+  SECTION("Accounts are found by id and created only once") {
+    AccountTable accounts;
+    REQUIRE(accounts.Find(1) == nullptr);
+    User *created = accounts.Insert(1, user);
+    REQUIRE(created != nullptr);
+    REQUIRE(accounts.Find(1) == created);
+    REQUIRE(accounts.Insert(1, user) == nullptr);
+    REQUIRE(accounts.size() == 1);
+  }
+
+  SECTION("Removed accounts are gone and their records are reused") {
+    AccountTable accounts;
+    for (std::uint64_t id = 0; id < 1000; ++id)
+      accounts.Insert(id, user);
+    for (std::uint64_t id = 0; id < 1000; id += 2)
+      REQUIRE(accounts.Remove(id));
+    REQUIRE(accounts.Remove(0) == false);
+    REQUIRE(accounts.size() == 500);
+    // Whatever shifted back into the gaps is still found.
+    for (std::uint64_t id = 0; id < 1000; ++id)
+      REQUIRE((accounts.Find(id) != nullptr) == (id % 2 == 1));
+    REQUIRE(accounts.Insert(0, user) != nullptr);
+    REQUIRE(accounts.size() == 501);
+  }
+
+  SECTION("Records keep their address while the table grows") {
+    AccountTable accounts;
+    std::vector<User *> created;
+    for (std::uint64_t id = 0; id < 10000; ++id)
+      created.push_back(accounts.Insert(id * 7919, user));
+    REQUIRE(accounts.size() == 10000);
+    for (std::uint64_t id = 0; id < 10000; ++id)
+      REQUIRE(accounts.Find(id * 7919) == created[id]);
+    REQUIRE(accounts.Find(1) == nullptr);
+  }
+}
+
+TEST_CASE("Engine") {
+  SECTION("Batches give the same responses as one command at a time") {
+    const std::vector<Command> commands = MakeWorkload(20000, 5000);
+    const std::string expected = RunSequential(commands);
+    for (std::size_t batch : {1, 3, 8, 64, 1000}) {
+      Engine engine;
+      ResponseWriter writer;
+      std::vector<Response> responses(batch);
+      for (std::size_t i = 0; i < commands.size(); i += batch) {
+        const std::size_t count = std::min(batch, commands.size() - i);
+        engine.HandleBatch(&commands[i], count, responses.data());
+        for (std::size_t j = 0; j < count; ++j)
+          writer.AppendResponse(responses[j]);
+      }
+      REQUIRE(writer.buffer() == expected);
+    }
+  }
+
+  SECTION("An exported account continues in the importing engine") {
+    std::vector<Command> commands = MakeWorkload(2000, 1);
+    for (auto &command : commands) {
+      command.account.id = 0;
+      command.transaction.account = 0;
+    }
+    const std::string expected = RunSequential(commands);
+    Engine first;
+    Engine second;
+    ResponseWriter writer;
+    Response response;
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+      Engine &engine = i < 1000 ? first : second;
+      if (i == 1000) {
+        std::unique_ptr<User> user;
+        first.Export(0, user);
+        REQUIRE(user != nullptr);
+        second.Import(0, *user);
+        REQUIRE(first.size() == 0);
+      }
+      engine.Handle(commands[i], response);
+      writer.AppendResponse(response);
+    }
+    REQUIRE(writer.buffer() == expected);
+  }
+}
+
+TEST_CASE("SpscRing") {
+  SECTION("Items come out in order and a full ring refuses pushes") {
+    SpscRing<int> ring(3);
+    REQUIRE(ring.capacity() == 4);
+    int item = 0;
+    REQUIRE(ring.TryPop(item) == false);
+    for (int i = 0; i < 4; ++i)
+      REQUIRE(ring.TryPush(i));
+    REQUIRE(ring.TryPush(4) == false);
+    for (int i = 0; i < 4; ++i) {
+      REQUIRE(ring.TryPop(item));
+      REQUIRE(item == i);
+    }
+    REQUIRE(ring.TryPop(item) == false);
+  }
+
+  SECTION("A producer and a consumer thread hand over every item") {
+    SpscRing<std::uint64_t> ring(8);
+    const std::uint64_t count = 100000;
+    std::thread producer([&ring, count] {
+      for (std::uint64_t i = 0; i < count; ++i)
+        ring.Push(i);
+    });
+    std::uint64_t expected = 0;
+    bool in_order = true;
+    for (std::uint64_t i = 0; i < count; ++i) {
+      std::uint64_t item;
+      ring.Pop(item);
+      in_order = in_order && item == expected++;
+    }
+    producer.join();
+    REQUIRE(in_order);
+  }
+}
+
+TEST_CASE("ShardedEngine") {
+  const std::vector<Command> commands = MakeWorkload(20000, 64);
+  const std::string expected = RunSequential(commands);
+
+  SECTION("Accounts always land on the same shard, within range") {
+    for (std::uint64_t id = 0; id < 1000; ++id) {
+      REQUIRE(ShardOf(id, 7) < 7);
+      REQUIRE(ShardOf(id, 7) == ShardOf(id, 7));
+    }
+    REQUIRE(ShardOf(12345, 1) == 0);
+  }
+
+  SECTION("Output matches one engine for any shard count") {
+    for (std::size_t shards : {1, 2, 3, 8}) {
+      // Small queues and window so submission keeps hitting back pressure.
+      std::ostringstream out;
+      ShardedEngine engine(shards, out, true, 4, 16);
+      for (const auto &command : commands)
+        engine.Submit(command);
+      engine.Finish();
+      REQUIRE(out.str() == expected);
+    }
+  }
+
+  SECTION("Moving accounts off a shard with a hot account keeps the output") {
+    // Half of the transactions hit account 1.
+    std::vector<Command> skewed = MakeWorkload(100000, 256);
+    for (std::size_t i = 256; i < skewed.size(); i += 2) {
+      if (skewed[i].type == kTransactionMessage)
+        skewed[i].transaction.account = 1;
+    }
+    const std::string skewed_expected = RunSequential(skewed);
+    std::ostringstream out;
+    ShardedEngine engine(4, out, true, 64, 256);
+    for (const auto &command : skewed)
+      engine.Submit(command);
+    REQUIRE(engine.balancer().moves() > 0);
+    engine.Finish();
+    REQUIRE(out.str() == skewed_expected);
+  }
+
+  SECTION("Unordered output holds the same responses, tagged by position") {
+    std::ostringstream out;
+    ShardedEngine engine(4, out, false, 4, 16);
+    for (const auto &command : commands)
+      engine.Submit(command);
+    engine.Finish();
+
+    std::vector<std::string> by_sequence(commands.size());
+    std::istringstream lines(out.str());
+    std::string line;
+    std::size_t count = 0;
+    while (std::getline(lines, line)) {
+      const std::string prefix = "{\"seq\":";
+      REQUIRE(line.compare(0, prefix.size(), prefix) == 0);
+      const std::size_t comma = line.find(',');
+      const std::size_t sequence =
+          std::stoul(line.substr(prefix.size(), comma - prefix.size()));
+      REQUIRE(sequence < by_sequence.size());
+      by_sequence[sequence] = "{" + line.substr(comma + 1) + "\n";
+      ++count;
+    }
+    REQUIRE(count == commands.size());
+    std::string reordered;
+    for (const auto &response : by_sequence)
+      reordered += response;
+    REQUIRE(reordered == expected);
+  }
+}
+
+TEST_CASE("WorkStealingDeque") {
+  SECTION("The owner pops newest first and thieves take the oldest") {
+    WorkStealingDeque deque(3);
+    REQUIRE(deque.capacity() == 4);
+    std::uint64_t item;
+    REQUIRE(deque.Pop(item) == false);
+    REQUIRE(deque.Steal(item) == false);
+    for (std::uint64_t i = 0; i < 4; ++i)
+      REQUIRE(deque.Push(i));
+    REQUIRE(deque.Push(4) == false);
+    REQUIRE(deque.Steal(item));
+    REQUIRE(item == 0);
+    REQUIRE(deque.Pop(item));
+    REQUIRE(item == 3);
+    REQUIRE(deque.Pop(item));
+    REQUIRE(item == 2);
+    REQUIRE(deque.Steal(item));
+    REQUIRE(item == 1);
+    REQUIRE(deque.Pop(item) == false);
+  }
+
+  SECTION("Every item is taken exactly once under contention") {
+    const std::uint64_t count = 200000;
+    WorkStealingDeque deque(64);
+    std::vector<int> taken(count, 0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> thieves;
+    std::vector<std::vector<std::uint64_t>> stolen(3);
+    for (std::size_t t = 0; t < stolen.size(); ++t) {
+      thieves.emplace_back([&deque, &done, &stolen, t] {
+        std::uint64_t item;
+        while (!done.load()) {
+          if (deque.Steal(item))
+            stolen[t].push_back(item);
+        }
+        while (deque.Steal(item))
+          stolen[t].push_back(item);
+      });
+    }
+    std::uint64_t item;
+    for (std::uint64_t i = 0; i < count; ++i) {
+      while (!deque.Push(i)) {
+        if (deque.Pop(item))
+          ++taken[item];
+      }
+      if (i % 3 == 0 && deque.Pop(item))
+        ++taken[item];
+    }
+    while (deque.Pop(item))
+      ++taken[item];
+    done.store(true);
+    for (auto &thief : thieves)
+      thief.join();
+    for (const auto &items : stolen) {
+      for (std::uint64_t stolen_item : items)
+        ++taken[stolen_item];
+    }
+    REQUIRE(std::count(taken.begin(), taken.end(), 1) == (long)count);
+  }
+}
+
+TEST_CASE("LoadBalancer") {
+  SECTION("Heavy hitters keep every id above 1/(K + 1) of the stream") {
+    HeavyHitters<4> hitters;
+    std::uint64_t id;
+    std::uint64_t count;
+    REQUIRE(hitters.Top(id, count) == false);
+    for (std::uint64_t i = 0; i < 1000; ++i) {
+      hitters.Add(i);
+      hitters.Add(7);
+    }
+    REQUIRE(hitters.Top(id, count));
+    REQUIRE(id == 7);
+    REQUIRE(count >= 1000 - 2000 / 5);
+    hitters.Clear();
+    REQUIRE(hitters.Top(id, count) == false);
+  }
+
+  SECTION("Even traffic stays where ShardOf puts it") {
+    LoadBalancer balancer(4, 1000);
+    std::size_t owner;
+    for (std::uint64_t i = 0; i < 10000; ++i) {
+      const std::size_t shard = balancer.Route(i % 500, owner);
+      REQUIRE(shard == owner);
+      REQUIRE(shard == ShardOf(i % 500, 4));
+    }
+    REQUIRE(balancer.moves() == 0);
+  }
+
+  SECTION("Cold accounts leave the shard of a hot account") {
+    LoadBalancer balancer(4, 1000);
+    const std::uint64_t hot = 0;
+    const std::size_t hot_shard = ShardOf(hot, 4);
+    std::size_t owner;
+    for (std::uint64_t i = 0; i < 1000; ++i)
+      balancer.Route(i % 2 == 0 ? hot : i, owner);
+    REQUIRE(balancer.draining(hot_shard));
+
+    // The hot account stays; a cold one on the same shard moves once.
+    REQUIRE(balancer.Route(hot, owner) == hot_shard);
+    std::uint64_t cold = 1;
+    while (ShardOf(cold, 4) != hot_shard)
+      ++cold;
+    const std::size_t moved = balancer.Route(cold, owner);
+    REQUIRE(owner == hot_shard);
+    REQUIRE(moved != hot_shard);
+    REQUIRE(balancer.ShardFor(cold) == moved);
+    REQUIRE(balancer.Route(cold, owner) == moved);
+    REQUIRE(owner == moved);
+    REQUIRE(balancer.moves() == 1);
+  }
+}
+
+TEST_CASE("ReorderBuffer") {
+  ReorderBuffer<int> buffer(3);
+  REQUIRE(buffer.capacity() == 4);
+  int value = -1;
+  REQUIRE(buffer.Pop(value) == false);
+
+  // 0 arrives last; nothing comes out until it does.
+  buffer.Put(2, 20);
+  buffer.Put(1, 10);
+  buffer.Put(3, 30);
+  REQUIRE(buffer.Pop(value) == false);
+  buffer.Put(0, 0);
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(buffer.Pop(value));
+    REQUIRE(value == i * 10);
+  }
+  REQUIRE(buffer.next() == 4);
+  REQUIRE(buffer.Pop(value) == false);
+
+  // Slots are reused for the next lap.
+  buffer.Put(4, 40);
+  REQUIRE(buffer.Pop(value));
+  REQUIRE(value == 40);
+}
+
+TEST_CASE("Pipeline") {
+  const std::vector<std::string> lines = MakeInputLines(20000, 64);
+  Engine engine;
+  ResponseWriter writer;
+  Message message;
+  Command command;
+  Response response;
+  for (const auto &line : lines) {
+    if (!DecodeCommand(line.data(), line.size(), message, command))
+      continue;
+    engine.Handle(command, response);
+    writer.AppendResponse(response);
+  }
+  const std::string expected = writer.buffer();
+
+  SECTION("Output matches the single threaded loop") {
+    for (std::size_t shards : {1, 3}) {
+      for (std::size_t parsers : {1, 4}) {
+        std::ostringstream out;
+        // A small ring so the reader keeps waiting on the dispatcher.
+        Pipeline pipeline(shards, parsers, out, true, 16);
+        VectorLineReader reader(lines);
+        pipeline.Run(reader);
+        REQUIRE(out.str() == expected);
+      }
+    }
+  }
+
+  SECTION("A very long line does not change the output") {
+    std::vector<std::string> skewed = lines;
+    // Same account creation, padded to several megabytes of whitespace.
+    skewed[1].insert(skewed[1].size() - 1, std::string(4 << 20, ' '));
+    std::ostringstream out;
+    Pipeline pipeline(2, 4, out, true, 64);
+    VectorLineReader reader(skewed);
+    pipeline.Run(reader);
+    REQUIRE(out.str() == expected);
+  }
+
+  SECTION("Empty input writes nothing") {
+    std::ostringstream out;
+    Pipeline pipeline(2, 2, out);
+    const std::vector<std::string> none;
+    VectorLineReader reader(none);
+    pipeline.Run(reader);
+    REQUIRE(out.str().empty());
+  }
+}
+
+TEST_CASE("Crc32c") {
+  SECTION("Known check values") {
+    REQUIRE(Crc32c("123456789", 9) == 0xe3069283u);
+    REQUIRE(Crc32c("", 0) == 0);
+  }
+
+  SECTION("Every implementation agrees, in one go or in pieces") {
+    std::string data;
+    for (int i = 0; i < 1000; ++i)
+      data.push_back((char)(i * 131 + 7));
+    for (std::size_t size : {0, 1, 7, 8, 9, 63, 1000})
+      REQUIRE(Crc32c(data.data(), size) ==
+              Crc32cSoftware(0, data.data(), size));
+    REQUIRE(Crc32c(data.data() + 13, 987, Crc32c(data.data(), 13)) ==
+            Crc32c(data.data(), 1000));
+  }
+}
+
+// One change as "account change" text, from a command or a log record.
+// Merchants are compared by name.
+std::string DescribeChange(const Command &command) {
+  std::ostringstream text;
+  if (command.type == kAccountMessage) {
+    text << command.account.id << " created " << command.account.active_card
+         << " " << command.account.available_limit;
+  } else {
+    const char *name;
+    std::size_t size;
+    Merchants().Name(command.transaction.merchant, name, size);
+    text << command.transaction.account << " charged "
+         << command.transaction.time << " " << command.transaction.amount
+         << " " << std::string(name, size);
+  }
+  return text.str();
+}
+
+// Changes in the log at path, in log order, and the number of bytes of it
+// holding valid records.
+std::vector<std::string> ReadChanges(const char *path, std::size_t &valid) {
+  WalReader reader;
+  REQUIRE(reader.Open(path));
+  std::vector<std::string> names;
+  std::vector<std::string> changes;
+  WalRecord record;
+  while (reader.Next(record)) {
+    std::ostringstream text;
+    if (record.type == kWalMerchantName) {
+      if (names.size() <= record.merchant_id)
+        names.resize(record.merchant_id + 1);
+      names[record.merchant_id] = Text(record.merchant_name);
+      continue;
+    }
+    if (record.type == kWalAccountCreated) {
+      text << record.account.id << " created " << record.account.active_card
+           << " " << record.account.available_limit;
+    } else {
+      REQUIRE(record.type == kWalTransactionApplied);
+      REQUIRE(record.transaction.merchant < names.size());
+      text << record.transaction.account << " charged "
+           << record.transaction.time << " " << record.transaction.amount
+           << " " << names[record.transaction.merchant];
+    }
+    changes.push_back(text.str());
+  }
+  valid = reader.offset();
+  return changes;
+}
+
+TEST_CASE("WriteAheadLog") {
+  char path[] = "/tmp/authenticator_wal_XXXXXX";
+  const int fd = mkstemp(path);
+  REQUIRE(fd >= 0);
+  close(fd);
+
+  // Changes a single Engine makes to lines, as DescribeChange text.
+  const std::vector<std::string> lines = MakeInputLines(3000, 16);
+  std::vector<Command> commands;
+  std::vector<std::string> expected;
+  {
+    Engine engine;
+    Message message;
+    Command command;
+    Response response;
+    for (const auto &line : lines) {
+      if (!DecodeCommand(line.data(), line.size(), message, command))
+        continue;
+      commands.push_back(command);
+      engine.Handle(command, response);
+      if (response.violations == kNoViolations)
+        expected.push_back(DescribeChange(command));
+    }
+  }
+  struct stat info;
+
+  SECTION("Every change is logged in order and durable after Sync") {
+    WriteAheadLog log(64, 1000);
+    REQUIRE(log.Open(path));
+    Engine engine(&log);
+    Response response;
+    for (const auto &command : commands)
+      engine.Handle(command, response);
+    log.Sync();
+    REQUIRE(log.durable() == log.logged());
+    REQUIRE(stat(path, &info) == 0);
+    std::size_t valid = 0;
+    REQUIRE(ReadChanges(path, valid) == expected);
+    REQUIRE(valid == (std::size_t)info.st_size);
+  }
+
+  SECTION("Sharded engines keep each account's changes in order") {
+    WriteAheadLog log;
+    REQUIRE(log.Open(path));
+    std::ostringstream out;
+    {
+      ShardedEngine engine(3, out, false, 4, 16, &log);
+      for (const auto &command : commands)
+        engine.Submit(command);
+    }
+    log.Close();
+    std::size_t valid = 0;
+    // Split both by account; the order between accounts is free.
+    std::map<std::string, std::vector<std::string>> logged;
+    std::map<std::string, std::vector<std::string>> wanted;
+    for (const auto &change : ReadChanges(path, valid))
+      logged[change.substr(0, change.find(' '))].push_back(change);
+    for (const auto &change : expected)
+      wanted[change.substr(0, change.find(' '))].push_back(change);
+    REQUIRE(logged == wanted);
+  }
+
+  SECTION("Reopening appends and a torn tail is dropped") {
+    for (int run = 0; run < 2; ++run) {
+      WriteAheadLog log;
+      REQUIRE(log.Open(path));
+      Engine engine(&log);
+      Response response;
+      for (const auto &command : commands)
+        engine.Handle(command, response);
+    }
+    std::vector<std::string> twice = expected;
+    twice.insert(twice.end(), expected.begin(), expected.end());
+    std::size_t valid = 0;
+    REQUIRE(ReadChanges(path, valid) == twice);
+
+    // A crash in the middle of the last record.
+    REQUIRE(stat(path, &info) == 0);
+    REQUIRE(truncate(path, info.st_size - 3) == 0);
+    twice.pop_back();
+    REQUIRE(ReadChanges(path, valid) == twice);
+    REQUIRE(valid < (std::size_t)info.st_size - 3);
+  }
+
+  SECTION("Files that are not logs are refused") {
+    std::ofstream(path) << "not a log\n";
+    WriteAheadLog log;
+    REQUIRE(log.Open(path) == false);
+    WalReader reader;
+    REQUIRE(reader.Open(path) == false);
+  }
+  unlink(path);
+}
+
+TEST_CASE("Snapshot") {
+  char directory[] = "/tmp/authenticator_snapshot_XXXXXX";
+  REQUIRE(mkdtemp(directory) != nullptr);
+  const std::string snapshot = std::string(directory) + "/snapshot";
+  const std::string wal = std::string(directory) + "/wal";
+
+  std::vector<Command> commands;
+  {
+    const std::vector<std::string> lines = MakeInputLines(6000, 32);
+    Message message;
+    Command command;
+    for (const auto &line : lines) {
+      if (DecodeCommand(line.data(), line.size(), message, command))
+        commands.push_back(command);
+    }
+  }
+  const std::string expected = RunSequential(commands);
+  const std::size_t quarter = commands.size() / 4;
+  const std::size_t half = 2 * quarter;
+  RestoreStats stats;
+  std::string error;
+
+  SECTION("An engine restarts from a snapshot and the log after it") {
+    ResponseWriter writer;
+    Response response;
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      for (std::size_t i = 0; i < half; ++i) {
+        if (i == quarter)
+          REQUIRE(WriteSnapshot(snapshot.c_str(), engine, &log));
+        engine.Handle(commands[i], response);
+        writer.AppendResponse(response);
+      }
+      // No snapshot at the end, as if the process died here.
+    }
+    WriteAheadLog log;
+    Engine engine(&log);
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    REQUIRE(stats.accounts > 0);
+    REQUIRE(stats.replayed > 0);
+    REQUIRE(stats.truncated == 0);
+    REQUIRE(log.Open(wal.c_str()));
+    for (std::size_t i = half; i < commands.size(); ++i) {
+      engine.Handle(commands[i], response);
+      writer.AppendResponse(response);
+    }
+    REQUIRE(writer.buffer() == expected);
+  }
+
+  SECTION("Sharded engines snapshot and restart with another shard count") {
+    std::ostringstream out;
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      ShardedEngine engine(3, out, true, 4, 16, &log);
+      for (std::size_t i = 0; i < half; ++i) {
+        if (i == quarter)
+          REQUIRE(engine.Snapshot(snapshot.c_str()));
+        engine.Submit(commands[i]);
+      }
+      engine.Finish();
+    }
+    WriteAheadLog log;
+    ShardedEngine engine(2, out, true, 4, 16, &log);
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    REQUIRE(log.Open(wal.c_str()));
+    for (std::size_t i = half; i < commands.size(); ++i)
+      engine.Submit(commands[i]);
+    engine.Finish();
+    REQUIRE(out.str() == expected);
+  }
+
+  SECTION("Snapshots written by forked children restart the same way") {
+    std::ostringstream out;
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      ShardedEngine engine(3, out, true, 4, 16, &log);
+      ForkedSnapshot child;
+      for (std::size_t i = 0; i < half; ++i) {
+        if (i == quarter)
+          REQUIRE(engine.ForkSnapshot(child, snapshot.c_str()));
+        engine.Submit(commands[i]);
+      }
+      REQUIRE(child.Wait());
+      REQUIRE(!child.running());
+      engine.Finish();
+    }
+    WriteAheadLog log;
+    ShardedEngine engine(2, out, true, 4, 16, &log);
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    REQUIRE(stats.accounts > 0);
+    REQUIRE(log.Open(wal.c_str()));
+    for (std::size_t i = half; i < commands.size(); ++i)
+      engine.Submit(commands[i]);
+    engine.Finish();
+    REQUIRE(out.str() == expected);
+
+    // A single engine forks from its own thread.
+    Engine single;
+    Response response;
+    for (std::size_t i = 0; i < quarter; ++i)
+      single.Handle(commands[i], response);
+    ForkedSnapshot child;
+    REQUIRE(child.Start(snapshot.c_str(), nullptr,
+                        [&](SnapshotFile &file) { file.Add(single); }));
+    REQUIRE(child.Wait());
+    Engine restored;
+    REQUIRE(Restore(snapshot.c_str(), nullptr, restored, stats, error));
+    ResponseWriter writer;
+    ResponseWriter restored_writer;
+    for (std::size_t i = quarter; i < commands.size(); ++i) {
+      single.Handle(commands[i], response);
+      writer.AppendResponse(response);
+      restored.Handle(commands[i], response);
+      restored_writer.AppendResponse(response);
+    }
+    REQUIRE(restored_writer.buffer() == writer.buffer());
+  }
+
+  SECTION("Restarting matches a continuous run when times go backwards") {
+    // The last transaction repeats the first one an hour and a half late,
+    // after a snapshot taken long after its group was last used.
+    const std::vector<std::string> lines = {
+        "{\"account\": {\"active-card\": true, \"available-limit\": 100}}",
+        "{\"transaction\": {\"merchant\": \"A\", \"amount\": 10, "
+        "\"time\": \"2019-02-13T10:00:00.000Z\"}}",
+        "{\"transaction\": {\"merchant\": \"B\", \"amount\": 10, "
+        "\"time\": \"2019-02-13T11:30:00.000Z\"}}",
+        "{\"transaction\": {\"merchant\": \"A\", \"amount\": 10, "
+        "\"time\": \"2019-02-13T10:00:30.000Z\"}}",
+    };
+    std::vector<Command> late;
+    Message message;
+    Command command;
+    for (const auto &line : lines) {
+      REQUIRE(DecodeCommand(line.data(), line.size(), message, command));
+      late.push_back(command);
+    }
+    const std::string late_expected = RunSequential(late);
+    REQUIRE(late_expected.find("doubled-transaction") != std::string::npos);
+
+    ResponseWriter writer;
+    Response response;
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      for (std::size_t i = 0; i < 3; ++i) {
+        engine.Handle(late[i], response);
+        writer.AppendResponse(response);
+      }
+      REQUIRE(WriteSnapshot(snapshot.c_str(), engine, &log));
+    }
+    Engine engine;
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    REQUIRE(stats.replayed == 0);
+    engine.Handle(late[3], response);
+    writer.AppendResponse(response);
+    REQUIRE(writer.buffer() == late_expected);
+  }
+
+  SECTION("Without a snapshot the whole log is replayed") {
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < half; ++i)
+        engine.Handle(commands[i], response);
+    }
+    Engine engine;
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    REQUIRE(stats.accounts == 0);
+    REQUIRE(stats.replayed > 0);
+  }
+
+  SECTION("Replaying the whole log on shards gives the same digest") {
+    std::uint64_t expected_digest;
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < half; ++i) {
+        if (i == quarter)
+          REQUIRE(WriteSnapshot(snapshot.c_str(), engine, &log));
+        engine.Handle(commands[i], response);
+      }
+      expected_digest = StateDigest(engine);
+      REQUIRE(expected_digest != 0);
+    }
+    for (std::size_t shards : {1, 3, 8}) {
+      std::ostringstream out;
+      ShardedEngine engine(shards, out);
+      std::uint64_t digest = 0;
+      RestoreStats recovered;
+      REQUIRE(RecoverFromLog(snapshot.c_str(), wal.c_str(), engine,
+                             recovered, digest, error));
+      REQUIRE(digest == expected_digest);
+      REQUIRE(engine.Digest() == expected_digest);
+      REQUIRE(recovered.replayed > 0);
+    }
+
+    // A snapshot the log does not lead to is caught.
+    {
+      Engine engine;
+      Response response;
+      for (std::size_t i = 0; i < quarter; ++i)
+        engine.Handle(commands[i + 1], response);
+      REQUIRE(StateDigest(engine) != expected_digest);
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      REQUIRE(WriteSnapshot(snapshot.c_str(), engine, &log));
+    }
+    std::ostringstream out;
+    ShardedEngine engine(2, out);
+    std::uint64_t digest = 0;
+    REQUIRE(RecoverFromLog(snapshot.c_str(), wal.c_str(), engine, stats,
+                           digest, error) == false);
+    REQUIRE(!error.empty());
+  }
+
+  SECTION("A change the log can not explain fails recovery") {
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < half; ++i)
+        engine.Handle(commands[i], response);
+    }
+    // Cut out the record naming the first merchant, so the transactions
+    // charged to it refer to an id the log never names.
+    std::ifstream in(wal, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+    in.close();
+    std::uint64_t begin = 0;
+    std::uint64_t end = 0;
+    {
+      WalReader reader;
+      REQUIRE(reader.Open(wal.c_str()));
+      WalRecord record;
+      while (end == 0) {
+        begin = reader.offset();
+        REQUIRE(reader.Next(record));
+        if (record.type == kWalMerchantName)
+          end = reader.offset();
+      }
+    }
+    bytes.erase(begin, end - begin);
+    std::ofstream(wal, std::ios::binary | std::ios::trunc) << bytes;
+
+    Engine engine;
+    REQUIRE(Restore(nullptr, wal.c_str(), engine, stats, error) == false);
+    REQUIRE(error.find("offset") != std::string::npos);
+    error.clear();
+    std::ostringstream out;
+    ShardedEngine sharded(2, out);
+    std::uint64_t digest = 0;
+    REQUIRE(RecoverFromLog(nullptr, wal.c_str(), sharded, stats, digest,
+                           error) == false);
+    REQUIRE(error.find("offset") != std::string::npos);
+  }
+
+  SECTION("Only a torn last record is cut off the log") {
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < half; ++i)
+        engine.Handle(commands[i], response);
+    }
+    struct stat info;
+    REQUIRE(stat(wal.c_str(), &info) == 0);
+    const off_t size = info.st_size;
+    std::uint64_t middle = 0;
+    {
+      WalReader reader;
+      REQUIRE(reader.Open(wal.c_str()));
+      WalRecord record;
+      while (reader.offset() < (std::uint64_t)size / 2)
+        REQUIRE(reader.Next(record));
+      middle = reader.offset();
+    }
+    // Flip a payload byte of the record in the middle.
+    std::fstream file(wal, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(middle + kWalHeaderSize);
+    const char byte = (char)(file.get() ^ 1);
+    file.seekp(middle + kWalHeaderSize);
+    file.put(byte);
+    file.close();
+
+    Engine engine;
+    REQUIRE(Restore(nullptr, wal.c_str(), engine, stats, error) == false);
+    REQUIRE(error.find("offset " + std::to_string(middle)) !=
+            std::string::npos);
+    error.clear();
+    std::ostringstream out;
+    ShardedEngine sharded(2, out);
+    std::uint64_t digest = 0;
+    REQUIRE(RecoverFromLog(nullptr, wal.c_str(), sharded, stats, digest,
+                           error) == false);
+    REQUIRE(error.find("offset " + std::to_string(middle)) !=
+            std::string::npos);
+    // Nothing after the damaged record was cut.
+    REQUIRE(stat(wal.c_str(), &info) == 0);
+    REQUIRE(info.st_size == size);
+    REQUIRE(stats.truncated == 0);
+
+    // Damaged as the last record, it is taken for a torn one.
+    REQUIRE(truncate(wal.c_str(), middle + kWalHeaderSize + 2) == 0);
+    Engine restarted;
+    REQUIRE(Restore(nullptr, wal.c_str(), restarted, stats, error));
+    REQUIRE(stats.truncated == kWalHeaderSize + 2);
+    REQUIRE(stat(wal.c_str(), &info) == 0);
+    REQUIRE(info.st_size == (off_t)middle);
+  }
+
+  SECTION("Changes to accounts the log did not create fail recovery") {
+    AccountMessage account;
+    account.id = 7;
+    account.active_card = true;
+    account.available_limit = 100;
+    const Transaction charge = {0, 10, InternMerchant("a"), 8};
+    for (int duplicate = 0; duplicate < 2; ++duplicate) {
+      unlink(wal.c_str());
+      std::uint64_t offset;
+      {
+        WriteAheadLog log;
+        REQUIRE(log.Open(wal.c_str()));
+        log.LogAccountCreated(account);
+        if (duplicate) {
+          offset = log.end_offset();
+          log.LogAccountCreated(account);
+        } else {
+          // Its merchant name record comes first.
+          log.LogTransactionApplied(charge);
+          offset = log.end_offset() - kWalHeaderSize - kWalTransactionSize;
+        }
+      }
+      const std::string expected_error =
+          "offset " + std::to_string(offset) +
+          (duplicate ? " creates account 7" : " charges account 8");
+
+      Engine engine;
+      REQUIRE(Restore(nullptr, wal.c_str(), engine, stats, error) == false);
+      REQUIRE(error.find(expected_error) != std::string::npos);
+      error.clear();
+      std::ostringstream out;
+      ShardedEngine sharded(2, out);
+      std::uint64_t digest = 0;
+      REQUIRE(RecoverFromLog(nullptr, wal.c_str(), sharded, stats, digest,
+                             error) == false);
+      REQUIRE(error.find(expected_error) != std::string::npos);
+      error.clear();
+    }
+  }
+
+  SECTION("An intact record of no known type fails recovery") {
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < quarter; ++i)
+        engine.Handle(commands[i], response);
+    }
+    struct stat info;
+    REQUIRE(stat(wal.c_str(), &info) == 0);
+    const std::uint64_t end = info.st_size;
+    // Type 99 with a good checksum, as the last record of the file.
+    char record[kWalHeaderSize + 1] = {0, 0, 0, 0, 1, 0, 0, 0, 99, 'x'};
+    const std::uint32_t crc = Crc32c(record + 4, sizeof(record) - 4);
+    std::memcpy(record, &crc, 4);
+    std::ofstream(wal, std::ios::binary | std::ios::app)
+        .write(record, sizeof(record));
+
+    Engine engine;
+    REQUIRE(Restore(nullptr, wal.c_str(), engine, stats, error) == false);
+    REQUIRE(error.find("offset " + std::to_string(end) +
+                       " is of no known type") != std::string::npos);
+    error.clear();
+    std::ostringstream out;
+    ShardedEngine sharded(2, out);
+    std::uint64_t digest = 0;
+    REQUIRE(RecoverFromLog(nullptr, wal.c_str(), sharded, stats, digest,
+                           error) == false);
+    REQUIRE(error.find("no known type") != std::string::npos);
+    REQUIRE(stat(wal.c_str(), &info) == 0);
+    REQUIRE((std::uint64_t)info.st_size == end + sizeof(record));
+  }
+
+  SECTION("A snapshot is only continued with the log it was cut from") {
+    // Written without a log, then a log with changes turns up.
+    {
+      Engine engine;
+      Response response;
+      for (std::size_t i = 0; i < half; ++i)
+        engine.Handle(commands[i], response);
+      REQUIRE(WriteSnapshot(snapshot.c_str(), engine, nullptr));
+    }
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      Engine engine(&log);
+      Response response;
+      for (std::size_t i = 0; i < quarter; ++i)
+        engine.Handle(commands[i], response);
+    }
+    std::ostringstream out;
+    std::uint64_t digest = 0;
+    {
+      Engine engine;
+      REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error) ==
+              false);
+      REQUIRE(error.find("without a log") != std::string::npos);
+      error.clear();
+      ShardedEngine sharded(2, out);
+      REQUIRE(RecoverFromLog(snapshot.c_str(), wal.c_str(), sharded, stats,
+                             digest, error) == false);
+      REQUIRE(error.find("without a log") != std::string::npos);
+      error.clear();
+    }
+
+    // Cut from that log, then restarted with another one.
+    {
+      WriteAheadLog log;
+      Engine engine(&log);
+      REQUIRE(Restore(nullptr, wal.c_str(), engine, stats, error));
+      REQUIRE(log.Open(wal.c_str()));
+      REQUIRE(WriteSnapshot(snapshot.c_str(), engine, &log));
+    }
+    {
+      Engine engine;
+      REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error));
+    }
+    unlink(wal.c_str());
+    {
+      WriteAheadLog log;
+      REQUIRE(log.Open(wal.c_str()));
+      AccountMessage account;
+      account.id = 123456789;
+      account.active_card = true;
+      account.available_limit = 1;
+      for (std::size_t i = 0; i < half; ++i) {
+        log.LogAccountCreated(account);
+        ++account.id;
+      }
+    }
+    Engine engine;
+    REQUIRE(Restore(snapshot.c_str(), wal.c_str(), engine, stats, error) ==
+            false);
+    REQUIRE(error.find("not cut from") != std::string::npos);
+    error.clear();
+    ShardedEngine sharded(2, out);
+    REQUIRE(RecoverFromLog(snapshot.c_str(), wal.c_str(), sharded, stats,
+                           digest, error) == false);
+    REQUIRE(error.find("not cut from") != std::string::npos);
+  }
+
+  SECTION("A damaged snapshot is refused") {
+    {
+      Engine engine;
+      Response response;
+      for (std::size_t i = 0; i < half; ++i)
+        engine.Handle(commands[i], response);
+      REQUIRE(WriteSnapshot(snapshot.c_str(), engine, nullptr));
+    }
+    std::fstream file(snapshot, std::ios::in | std::ios::out |
+                                    std::ios::binary);
+    file.seekg(kSnapshotHeaderSize + 10);
+    const char byte = (char)(file.get() ^ 1);
+    file.seekp(kSnapshotHeaderSize + 10);
+    file.put(byte);
+    file.close();
+    Engine engine;
+    REQUIRE(Restore(snapshot.c_str(), nullptr, engine, stats, error) ==
+            false);
+    REQUIRE(!error.empty());
+  }
+  unlink(snapshot.c_str());
+  unlink(wal.c_str());
+  rmdir(directory);
+}
@@ -0,0 +1,535 @@
+#ifndef wal_h
+#define wal_h
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "globals.h"
+#include "merchants.h"
+#include "parser.h"
+
+// Lookup table for CRC32C (Castagnoli polynomial, reflected 0x82f63b78), one
+// byte at a time.
+struct Crc32cTable {
+  Crc32cTable() {
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      std::uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+      entries[i] = crc;
+    }
+  }
+
+  std::uint32_t entries[256];
+};
+
+std::uint32_t Crc32cSoftware(std::uint32_t crc, const char *data,
+                             std::size_t size) {
+  static const Crc32cTable table;
+  crc = ~crc;
+  for (std::size_t i = 0; i < size; ++i)
+    crc = (crc >> 8) ^ table.entries[(crc ^ (unsigned char)data[i]) & 0xff];
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+// Same as Crc32cSoftware with the SSE4.2 crc32 instruction, 8 bytes per
+// step. Only call it if the CPU has SSE4.2.
+__attribute__((target("sse4.2"))) std::uint32_t
+Crc32cHardware(std::uint32_t crc, const char *data, std::size_t size) {
+  std::uint64_t crc64 = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  std::uint32_t crc32 = (std::uint32_t)crc64;
+  for (; size > 0; ++data, --size)
+    crc32 = _mm_crc32_u8(crc32, (unsigned char)*data);
+  return ~crc32;
+}
+#endif
+
+// CRC32C of [data, data + size), continuing from crc (0 to start). Uses the
+// crc32 instruction when the CPU running the binary has it, so the build
+// does not need -msse4.2.
+std::uint32_t Crc32c(const char *data, std::size_t size,
+                     std::uint32_t crc = 0) {
+#if defined(__x86_64__)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware)
+    return Crc32cHardware(crc, data, size);
+#endif
+  return Crc32cSoftware(crc, data, size);
+}
+
+// Kind of a log record.
+enum WalRecordType {
+  kNoWalRecord = 0,
+  // An account was created: id, limit and card status.
+  kWalAccountCreated,
+  // A transaction was accepted and charged to its account.
+  kWalTransactionApplied,
+  // Merchant id stands for a name in the transactions that follow it.
+  kWalMerchantName,
+};
+
+// First bytes of every log file.
+const char kWalMagic[8] = {'A', 'U', 'T', 'H', 'W', 'A', 'L', '1'};
+
+// Every record starts with a header: the CRC32C of everything after the
+// crc field (the rest of the header and the payload), the payload size and
+// the type. Fields are in host byte order.
+const std::size_t kWalHeaderSize = 4 + 4 + 1;
+
+// Identity of a log, as a snapshot records it to be checked against the log
+// it is restarted with: the CRC of the log's first record with bit 32 set,
+// or kWalWithoutRecords while it has none. 0 stands for no log at all.
+const std::uint64_t kWalWithoutRecords = 1ULL << 32;
+
+// Identity of the log whose file starts with size bytes at data.
+std::uint64_t WalIdentity(const char *data, std::size_t size) {
+  if (size < sizeof(kWalMagic) + 4)
+    return kWalWithoutRecords;
+  std::uint32_t crc;
+  std::memcpy(&crc, data + sizeof(kWalMagic), 4);
+  return kWalWithoutRecords | crc;
+}
+const std::size_t kWalAccountSize = 8 + 8 + 1;
+const std::size_t kWalTransactionSize = 8 + 8 + 8 + 4;
+
+// A decoded log record. Only the fields of type are meaningful.
+struct WalRecord {
+  WalRecordType type = kNoWalRecord;
+  // kWalAccountCreated.
+  AccountMessage account;
+  // kWalTransactionApplied; merchant is an id of this log's dictionary.
+  Transaction transaction = {0, 0, 0, 0};
+  // kWalMerchantName; the name points into the reader's buffer.
+  std::uint32_t merchant_id = 0;
+  TextView merchant_name;
+};
+
+// Append-only binary log of every accepted change to account state, written
+// before the responses that report them leave the process, so a crash never
+// loses a change a client was told about.
+//
+// Logging a change only appends the record to an in-memory buffer. A
+// committer thread writes the buffer out and fdatasyncs it as a group once
+// commit_records records are pending or the oldest pending record has
+// waited commit_micros, so one sync covers many transactions. Sync blocks
+// until everything logged so far is durable; callers run it before writing
+// out responses. Merchant names are logged the first time a transaction
+// uses their id, since ids are only meaningful within one process.
+//
+// Any thread may log. A failed write or sync leaves no way to keep the
+// promise, so it ends the process.
+class WriteAheadLog {
+public:
+  static const std::size_t kDefaultCommitRecords = 1024;
+  static const std::size_t kDefaultCommitMicros = 1000;
+
+  explicit WriteAheadLog(std::size_t commit_records = kDefaultCommitRecords,
+                         std::size_t commit_micros = kDefaultCommitMicros)
+      : commit_records_(commit_records > 0 ? commit_records : 1),
+        commit_delay_(commit_micros), fd_(-1), pending_(0), logged_(0),
+        durable_(0), end_(0), identity_(kWalWithoutRecords),
+        merchants_logged_(0), closing_(false) {}
+
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  ~WriteAheadLog() { Close(); }
+
+  // Opens path for appending, creating it if needed, and starts the
+  // committer. Returns false and leaves errno set if it can not be opened or
+  // is not a log. Call at most once.
+  bool Open(const char *path) {
+    fd_ = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd_, &info) != 0) {
+      CloseFile();
+      return false;
+    }
+    if (info.st_size == 0) {
+      buffer_.append(kWalMagic, sizeof(kWalMagic));
+      oldest_ = Clock::now();
+    } else if (!ReadIdentity(path, identity_)) {
+      CloseFile();
+      errno = EINVAL;
+      return false;
+    }
+    end_ = info.st_size + buffer_.size();
+    buffer_.reserve(kInitialBuffer);
+    writing_.reserve(kInitialBuffer);
+    committer_ = std::thread(&WriteAheadLog::Commit, this);
+    return true;
+  }
+
+  // Makes everything logged durable and stops the committer.
+  void Close() {
+    if (!committer_.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    work_.notify_one();
+    committer_.join();
+    CloseFile();
+  }
+
+  void LogAccountCreated(const AccountMessage &account) {
+    char payload[kWalAccountSize];
+    std::memcpy(payload, &account.id, 8);
+    std::memcpy(payload + 8, &account.available_limit, 8);
+    payload[16] = account.active_card ? 1 : 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Append(kWalAccountCreated, payload, sizeof(payload));
+  }
+
+  void LogTransactionApplied(const Transaction &txn) {
+    char payload[kWalTransactionSize];
+    std::memcpy(payload, &txn.account, 8);
+    std::memcpy(payload + 8, &txn.time, 8);
+    std::memcpy(payload + 16, &txn.amount, 8);
+    std::memcpy(payload + 24, &txn.merchant, 4);
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (merchants_logged_ <= txn.merchant)
+      AppendMerchant(merchants_logged_++);
+    Append(kWalTransactionApplied, payload, sizeof(payload));
+  }
+
+  // Blocks until every record logged before the call is durable.
+  void Sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const std::uint64_t target = logged_;
+    durable_changed_.wait(lock, [&] { return durable_ >= target; });
+  }
+
+  // Records logged and records known durable so far.
+  std::uint64_t logged() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return logged_;
+  }
+
+  std::uint64_t durable() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return durable_;
+  }
+
+  // See WalIdentity.
+  std::uint64_t identity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return identity_;
+  }
+
+  // Size the file will have once everything logged so far is written, i.e.
+  // the offset where the next record goes.
+  std::uint64_t end_offset() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return end_;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  static const std::size_t kInitialBuffer = 1 << 20;
+
+  // Checks that path starts like a log and stores its identity. Returns
+  // false if it does not.
+  static bool ReadIdentity(const char *path, std::uint64_t &identity) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    char start[sizeof(kWalMagic) + 4];
+    const ssize_t count = read(fd, start, sizeof(start));
+    close(fd);
+    if (count < (ssize_t)sizeof(kWalMagic) ||
+        std::memcmp(start, kWalMagic, sizeof(kWalMagic)) != 0)
+      return false;
+    identity = WalIdentity(start, count);
+    return true;
+  }
+
+  // Adds a record to the buffer and wakes the committer when the group
+  // starts or fills up. Called with the lock held.
+  void Append(WalRecordType type, const char *payload, std::size_t size) {
+    char header[kWalHeaderSize];
+    const std::uint32_t payload_size = (std::uint32_t)size;
+    std::memcpy(header + 4, &payload_size, 4);
+    header[8] = (char)type;
+    std::uint32_t crc = Crc32c(header + 4, kWalHeaderSize - 4);
+    crc = Crc32c(payload, size, crc);
+    std::memcpy(header, &crc, 4);
+    if (end_ == sizeof(kWalMagic))
+      identity_ = kWalWithoutRecords | crc;
+    buffer_.append(header, kWalHeaderSize);
+    buffer_.append(payload, size);
+    end_ += kWalHeaderSize + size;
+    ++logged_;
+    if (++pending_ == 1) {
+      oldest_ = Clock::now();
+      work_.notify_one();
+    } else if (pending_ == commit_records_) {
+      work_.notify_one();
+    }
+  }
+
+  void AppendMerchant(std::uint32_t id) {
+    const char *name;
+    std::size_t size;
+    Merchants().Name(id, name, size);
+    std::string &payload = merchant_payload_;
+    payload.assign((const char *)&id, 4);
+    payload.append(name, size);
+    Append(kWalMerchantName, payload.data(), payload.size());
+  }
+
+  // Body of the committer thread.
+  void Commit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (pending_ == 0 && buffer_.empty()) {
+        if (closing_)
+          return;
+        work_.wait(lock);
+        continue;
+      }
+      if (!closing_ && pending_ < commit_records_ &&
+          work_.wait_until(lock, oldest_ + commit_delay_) !=
+              std::cv_status::timeout)
+        continue;
+      // Take the group and let logging go on into the other buffer.
+      buffer_.swap(writing_);
+      const std::uint64_t group_end = logged_;
+      pending_ = 0;
+      lock.unlock();
+      WriteOut(writing_);
+      writing_.clear();
+      lock.lock();
+      durable_ = group_end;
+      durable_changed_.notify_all();
+    }
+  }
+
+  void WriteOut(const std::string &bytes) {
+    const char *p = bytes.data();
+    std::size_t left = bytes.size();
+    while (left > 0) {
+      const ssize_t count = write(fd_, p, left);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        Fail("write");
+      p += count;
+      left -= count;
+    }
+#if defined(__linux__)
+    if (fdatasync(fd_) != 0)
+#else
+    if (fsync(fd_) != 0)
+#endif
+      Fail("sync");
+  }
+
+  static void Fail(const char *what) {
+    std::cerr << "write-ahead log " << what << " failed: "
+              << std::strerror(errno) << "\n";
+    std::abort();
+  }
+
+  void CloseFile() {
+    if (fd_ >= 0)
+      close(fd_);
+    fd_ = -1;
+  }
+
+  const std::size_t commit_records_;
+  const std::chrono::microseconds commit_delay_;
+  int fd_;
+  // Everything below is guarded by mutex_, except writing_, which only the
+  // committer touches while it is unlocked.
+  mutable std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable durable_changed_;
+  // Records not written yet, and when the first of them was logged.
+  std::string buffer_;
+  std::string writing_;
+  std::string merchant_payload_;
+  std::size_t pending_;
+  Clock::time_point oldest_;
+  std::uint64_t logged_;
+  std::uint64_t durable_;
+  std::uint64_t end_;
+  std::uint64_t identity_;
+  // Merchant ids below this one have their name in the log.
+  std::uint32_t merchants_logged_;
+  bool closing_;
+  std::thread committer_;
+};
+
+// Reads back the records of a log file, stopping at the first incomplete or
+// corrupt one. A crash can only leave a partly written record at the very
+// end, and none of it was reported durable; a bad record with more of the
+// file after it is corruption instead, and the reader says so (corruption)
+// so that nobody mistakes the durable records after it for a torn tail.
+// The file is memory mapped, so reading only the tail of a long log costs
+// no more than the tail.
+class WalReader {
+public:
+  WalReader() : data_(nullptr), size_(0), offset_(0), corruption_(nullptr) {}
+
+  ~WalReader() {
+    if (data_ != nullptr)
+      munmap((void *)data_, size_);
+  }
+
+  WalReader(const WalReader &) = delete;
+  WalReader &operator=(const WalReader &) = delete;
+
+  // Maps path and positions the reader at byte offset from, which must be
+  // where a record starts (0 for the first one). Returns false and leaves
+  // errno set if it can not be read, is not a log (an empty file is one)
+  // or is shorter than from.
+  bool Open(const char *path, std::uint64_t from = 0) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      const int error = errno;
+      close(fd);
+      errno = error;
+      return false;
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return false;
+      }
+      data_ = (const char *)data;
+      madvise(data, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    // An empty file is a log nothing was written to yet.
+    const bool is_log =
+        size_ == 0 ||
+        (size_ >= sizeof(kWalMagic) &&
+         std::memcmp(data_, kWalMagic, sizeof(kWalMagic)) == 0);
+    if (!is_log || from > size_) {
+      errno = EINVAL;
+      return false;
+    }
+    offset_ = size_ == 0 || from > sizeof(kWalMagic) ? from : sizeof(kWalMagic);
+    return true;
+  }
+
+  // Decodes the next record into record and returns true, or returns false
+  // at the end of the valid records. Names point into the mapping and stay
+  // valid while the reader lives.
+  bool Next(WalRecord &record) {
+    const std::size_t left = size_ - offset_;
+    if (left < kWalHeaderSize)
+      return false;
+    const char *header = data_ + offset_;
+    std::uint32_t crc;
+    std::uint32_t size;
+    std::memcpy(&crc, header, 4);
+    std::memcpy(&size, header + 4, 4);
+    if (size > left - kWalHeaderSize)
+      return false;
+    const char *payload = header + kWalHeaderSize;
+    if (Crc32c(header + 4, kWalHeaderSize - 4 + size) != crc) {
+      // The last record may have been cut short by a crash at any byte.
+      if (size < left - kWalHeaderSize)
+        corruption_ = "fails its checksum, with more of the log after it";
+      return false;
+    }
+    // Intact, so a record Decode refuses was written like this.
+    corruption_ = Decode((WalRecordType)header[8], payload, size, record);
+    if (corruption_ != nullptr)
+      return false;
+    offset_ += kWalHeaderSize + size;
+    return true;
+  }
+
+  // Once Next has returned false: why the record at offset can not be the
+  // torn tail a crash leaves, or nullptr if it can (or the file ended).
+  const char *corruption() const { return corruption_; }
+
+  // Offset just past the last record read: where the valid part of the
+  // file ends once Next has returned false.
+  std::uint64_t offset() const { return offset_; }
+
+  // Size of the whole file.
+  std::uint64_t size() const { return size_; }
+
+  // See WalIdentity.
+  std::uint64_t identity() const { return WalIdentity(data_, size_); }
+
+private:
+  // Returns nullptr once record holds the payload, or why it can not.
+  static const char *Decode(WalRecordType type, const char *payload,
+                            std::size_t size, WalRecord &record) {
+    const char *const wrong_size = "has the wrong size for its type";
+    record.type = type;
+    switch (type) {
+    case kWalAccountCreated:
+      if (size != kWalAccountSize)
+        return wrong_size;
+      std::memcpy(&record.account.id, payload, 8);
+      std::memcpy(&record.account.available_limit, payload + 8, 8);
+      record.account.active_card = payload[16] != 0;
+      return nullptr;
+    case kWalTransactionApplied:
+      if (size != kWalTransactionSize)
+        return wrong_size;
+      std::memcpy(&record.transaction.account, payload, 8);
+      std::memcpy(&record.transaction.time, payload + 8, 8);
+      std::memcpy(&record.transaction.amount, payload + 16, 8);
+      std::memcpy(&record.transaction.merchant, payload + 24, 4);
+      return nullptr;
+    case kWalMerchantName:
+      if (size < 4)
+        return wrong_size;
+      std::memcpy(&record.merchant_id, payload, 4);
+      record.merchant_name.data = payload + 4;
+      record.merchant_name.size = size - 4;
+      return nullptr;
+    default:
+      return "is of no known type";
+    }
+  }
+
+  const char *data_;
+  std::size_t size_;
+  std::size_t offset_;
+  const char *corruption_;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef window_h
+#define window_h
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Fixed capacity ring of the last N timestamps pushed into it. Once full,
+// every Push overwrites the oldest entry so the footprint is always N values
+// no matter how many transactions an account accumulates.
+template <std::size_t N> class TimeWindow {
+public:
+  static_assert(N > 0, "TimeWindow needs room for at least one timestamp");
+
+  TimeWindow() : head_(0), size_(0) {}
+
+  // Number of timestamps currently held, never more than N.
+  std::size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  static std::size_t capacity() { return N; }
+
+  // Appends time as the newest entry, evicting the oldest one when full.
+  void Push(long long time) {
+    times_[head_] = time;
+    head_ = head_ + 1 == N ? 0 : head_ + 1;
+    if (size_ < N)
+      ++size_;
+  }
+
+  // Returns the i-th newest timestamp, Back(1) being the newest one.
+  // Requires 1 <= i <= size().
+  long long Back(std::size_t i) const {
+    assert(i >= 1 && i <= size_);
+    return times_[head_ >= i ? head_ - i : head_ + N - i];
+  }
+
+private:
+  long long times_[N];
+  // Slot the next Push writes to.
+  std::size_t head_;
+  std::size_t size_;
+};
+
+// Open addressing (linear probing) table from Key to the TimeWindow<N> of its
+// last N times. Hash must return a 64-bit hash of Key; it is stored per slot
+// and compared before the full key so collisions are still told apart.
+//
+// Times are measured against the horizon, window before the newest time
+// pushed so far. A time before the horizon is late. A key expires once all
+// its times are window before the horizon: no time that is not late can
+// fall within window of it anymore. Expired keys are gone for Find and
+// ForEach the moment they expire, so lookups only depend on what was pushed;
+// their slots are reclaimed lazily, by inserts that reuse them and by
+// rebuilds that drop them, so the table holds the keys of the last two
+// windows instead of every key ever seen. Late times are for the caller to
+// handle (see IsLate), as the keys they would repeat may have expired.
+template <typename Key, typename Hash, std::size_t N> class WindowMap {
+public:
+  explicit WindowMap(long long window)
+      : size_(0), window_(window), newest_(LLONG_MIN) {
+    assert(window > 0);
+  }
+
+  // Number of occupied slots, expired keys not reclaimed yet included.
+  std::size_t size() const { return size_; }
+
+  std::size_t capacity() const { return slots_.size(); }
+
+  long long window() const { return window_; }
+
+  // Whether time is before the horizon. Always false before the first Push.
+  bool IsLate(long long time) const {
+    return newest_ != LLONG_MIN && time < newest_ - window_;
+  }
+
+  // Returns the window of key or nullptr when key is absent or expired.
+  const TimeWindow<N> *Find(const Key &key) const {
+    if (slots_.empty())
+      return nullptr;
+    const std::uint64_t hash = HashOf(key);
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = hash & mask; slots_[i].hash != 0; i = (i + 1) & mask) {
+      if (slots_[i].hash == hash && slots_[i].key == key)
+        return IsExpired(slots_[i]) ? nullptr : &slots_[i].times;
+    }
+    return nullptr;
+  }
+
+  // Starts loading the slot key hashes to, so a Find or Push shortly after
+  // does not wait on memory.
+  void Prefetch(const Key &key) const {
+    if (!slots_.empty())
+      __builtin_prefetch(&slots_[HashOf(key) & (slots_.size() - 1)]);
+  }
+
+  // Calls f(key, window) for every key that has not expired, in no
+  // particular order.
+  template <typename F> void ForEach(F f) const {
+    for (const auto &slot : slots_) {
+      if (slot.hash != 0 && !IsExpired(slot))
+        f(slot.key, slot.times);
+    }
+  }
+
+  // Pushes time into the window of key, creating the entry when absent or
+  // expired.
+  void Push(const Key &key, long long time) {
+    if (time > newest_)
+      newest_ = time;
+    if ((size_ + 1) * 4 > slots_.size() * 3)
+      Rehash();
+
+    const std::uint64_t hash = HashOf(key);
+    const std::size_t mask = slots_.size() - 1;
+    std::size_t reuse = slots_.size();
+    std::size_t i = hash & mask;
+    for (; slots_[i].hash != 0; i = (i + 1) & mask) {
+      if (slots_[i].hash == hash && slots_[i].key == key) {
+        // An expired key starts over, as if it had been reclaimed.
+        if (IsExpired(slots_[i]))
+          slots_[i].times = TimeWindow<N>();
+        slots_[i].times.Push(time);
+        return;
+      }
+      if (reuse == slots_.size() && IsExpired(slots_[i]))
+        reuse = i;
+    }
+
+    // Key is absent; take over the first expired slot on its probe path if
+    // any.
+    if (reuse == slots_.size()) {
+      reuse = i;
+      ++size_;
+    }
+    Slot &slot = slots_[reuse];
+    slot.hash = hash;
+    slot.key = key;
+    slot.times = TimeWindow<N>();
+    slot.times.Push(time);
+  }
+
+private:
+  struct Slot {
+    // 0 marks an empty slot.
+    std::uint64_t hash = 0;
+    Key key;
+    TimeWindow<N> times;
+  };
+
+  static std::uint64_t HashOf(const Key &key) {
+    const std::uint64_t hash = Hash()(key);
+    return hash == 0 ? 1 : hash;
+  }
+
+  // Only called on occupied slots, so newest_ is a pushed time. Times of a
+  // key need not be pushed in order, so all of them are compared.
+  bool IsExpired(const Slot &slot) const {
+    for (std::size_t i = 1; i <= slot.times.size(); ++i) {
+      if (newest_ - slot.times.Back(i) < 2 * window_)
+        return false;
+    }
+    return true;
+  }
+
+  // Rebuilds the table without expired keys, sized so that the others fill
+  // at most half of it. This may shrink the table as well as grow it. Kept
+  // keys are parked in a per-thread scratch vector shared by all tables, so
+  // once the key count settles a rebuild reuses both buffers and never
+  // allocates.
+  void Rehash() {
+    static thread_local std::vector<Slot> scratch;
+    scratch.clear();
+    for (const auto &slot : slots_) {
+      if (slot.hash != 0 && !IsExpired(slot))
+        scratch.push_back(slot);
+    }
+    std::size_t capacity = 8;
+    while (capacity < (scratch.size() + 1) * 2)
+      capacity *= 2;
+
+    if (capacity == slots_.size())
+      std::fill(slots_.begin(), slots_.end(), Slot());
+    else
+      std::vector<Slot>(capacity).swap(slots_);
+    size_ = scratch.size();
+    const std::size_t mask = slots_.size() - 1;
+    for (const auto &slot : scratch) {
+      std::size_t i = slot.hash & mask;
+      while (slots_[i].hash != 0)
+        i = (i + 1) & mask;
+      slots_[i] = slot;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_;
+  long long window_;
+  // Newest time pushed so far; the horizon is window_ before it.
+  long long newest_;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef writer_h
+#define writer_h
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "globals.h"
+
+// Piece of output text with its length known at compile time.
+struct Fragment {
+  const char *data;
+  std::size_t size;
+};
+
+#define FRAGMENT(literal)                                                      \
+  { literal, sizeof(literal) - 1 }
+
+// Quoted violation names indexed by GenericErrors, as they appear inside the
+// "violations" array.
+const Fragment kViolationFragments[] = {
+    FRAGMENT("\"Ok\""),
+    FRAGMENT("\"account-already-initialized\""),
+    FRAGMENT("\"account-not-initialized\""),
+    FRAGMENT("\"card-not-active\""),
+    FRAGMENT("\"insufficient-limit\""),
+    FRAGMENT("\"high-frequency-small-interval\""),
+    FRAGMENT("\"doubled-transaction\""),
+};
+
+static_assert(sizeof(kViolationFragments) / sizeof(kViolationFragments[0]) ==
+                  kViolationCount,
+              "every violation needs an output fragment");
+
+// "00" to "99" back to back, used to format integers two digits at a time.
+const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+// Outcome of one message: everything needed to render its response, so a
+// message can be evaluated on one thread and rendered on another.
+struct Response {
+  // false for {"violations":[...]} responses without an account object.
+  bool has_account = false;
+  std::uint64_t account_id = 0;
+  bool active_card = false;
+  long long available_limit = 0;
+  Violations violations = kNoViolations;
+};
+
+// Renders responses straight into a reusable buffer, producing the same text
+// as building the nlohmann::json output and calling dump() (keys in sorted
+// order, no whitespace) without any intermediate objects. Violation names
+// are written in bit order, which is the order the checks run in.
+class ResponseWriter {
+public:
+  ResponseWriter() { buffer_.reserve(kFlushSize); }
+
+  // Appends {"account":{...},"violations":[...]} and a newline. "account-id"
+  // is only written for accounts other than 0, so inputs without ids get the
+  // same responses as before.
+  void AppendAccountResponse(std::uint64_t account_id, bool active_card,
+                             long long available_limit,
+                             Violations violations) {
+    buffer_.push_back('{');
+    AppendAccountFields(account_id, active_card, available_limit, violations);
+  }
+
+  // Appends {"violations":[...]} and a newline, for responses without an
+  // account.
+  void AppendViolationsResponse(Violations violations) {
+    buffer_.push_back('{');
+    AppendViolationsFields(violations);
+  }
+
+  // Appends whichever of the two shapes above response describes.
+  void AppendResponse(const Response &response) {
+    buffer_.push_back('{');
+    AppendFields(response);
+  }
+
+  // Same as AppendResponse with "seq":sequence as the first key, for output
+  // that is not in input order and has to say which message it answers.
+  void AppendTaggedResponse(std::uint64_t sequence, const Response &response) {
+    Append(FRAGMENT("{\"seq\":"));
+    AppendUnsigned(sequence);
+    buffer_.push_back(',');
+    AppendFields(response);
+  }
+
+  const std::string &buffer() const { return buffer_; }
+
+  std::size_t size() const { return buffer_.size(); }
+
+  void clear() { buffer_.clear(); }
+
+  // Whether enough output is pending to be worth a write.
+  bool Full() const { return buffer_.size() >= kFlushSize; }
+
+  // Writes everything pending to out in one call and empties the buffer,
+  // keeping its capacity.
+  void Flush(std::ostream &out) {
+    if (buffer_.empty())
+      return;
+    out.write(buffer_.data(), buffer_.size());
+    out.flush();
+    buffer_.clear();
+  }
+
+private:
+  static const std::size_t kFlushSize = 64 * 1024;
+
+  // The rest of a response after its opening brace, through the newline.
+  void AppendFields(const Response &response) {
+    if (response.has_account)
+      AppendAccountFields(response.account_id, response.active_card,
+                          response.available_limit, response.violations);
+    else
+      AppendViolationsFields(response.violations);
+  }
+
+  void AppendAccountFields(std::uint64_t account_id, bool active_card,
+                           long long available_limit, Violations violations) {
+    Append(FRAGMENT("\"account\":{"));
+    if (account_id != 0) {
+      Append(FRAGMENT("\"account-id\":"));
+      AppendUnsigned(account_id);
+      buffer_.push_back(',');
+    }
+    Append(FRAGMENT("\"active-card\":"));
+    if (active_card)
+      Append(FRAGMENT("true"));
+    else
+      Append(FRAGMENT("false"));
+    Append(FRAGMENT(",\"available-limit\":"));
+    AppendInteger(available_limit);
+    Append(FRAGMENT("},"));
+    AppendViolationsFields(violations);
+  }
+
+  void AppendViolationsFields(Violations violations) {
+    AppendViolations(violations);
+    Append(FRAGMENT("}\n"));
+  }
+
+  void Append(const Fragment &fragment) {
+    buffer_.append(fragment.data, fragment.size);
+  }
+
+  void AppendViolations(Violations violations) {
+    Append(FRAGMENT("\"violations\":["));
+    violations &= (1u << kViolationCount) - 1;
+    while (violations != kNoViolations) {
+      // Lowest set bit first, then clear it.
+      Append(kViolationFragments[__builtin_ctz(violations)]);
+      violations &= violations - 1;
+      if (violations != kNoViolations)
+        buffer_.push_back(',');
+    }
+    buffer_.push_back(']');
+  }
+
+  void AppendInteger(long long value) {
+    if (value < 0) {
+      buffer_.push_back('-');
+      AppendUnsigned(0ULL - (unsigned long long)value);
+    } else {
+      AppendUnsigned((unsigned long long)value);
+    }
+  }
+
+  void AppendUnsigned(unsigned long long value) {
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    while (value >= 100) {
+      const unsigned int pair = (unsigned int)(value % 100) * 2;
+      value /= 100;
+      *--p = kDigitPairs[pair + 1];
+      *--p = kDigitPairs[pair];
+    }
+    if (value >= 10) {
+      const unsigned int pair = (unsigned int)value * 2;
+      *--p = kDigitPairs[pair + 1];
+      *--p = kDigitPairs[pair];
+    } else {
+      *--p = (char)('0' + value);
+    }
+    buffer_.append(p, end - p);
+  }
+
+  std::string buffer_;
+};
+
+#endif
@@ -1,107 +1,423 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "json.hpp"
 
+#include "engine.h"
 #include "globals.h"
-#include "utils.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "reader.h"
+#include "recovery.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "writer.h"
 
-std::vector<User> users;
-std::stringstream ss;
+ResponseWriter writer;
 
-void HandleAccountCreation(nlohmann::json user_json) {
-  nlohmann::json output;
-  output["violations"] = std::vector<std::string>();
+// Writes out the pending responses once log, if any, holds their changes.
+void Flush(WriteAheadLog *log) {
+  if (log != nullptr && writer.size() > 0)
+    log->Sync();
+  writer.Flush(std::cout);
+}
 
-  // Verify if current account is active.
-  if (users.empty()) {
-    users.push_back(User(user_json));
-  } else {
-    output["violations"].push_back(
-        ErrorToViolation(kAccountAlreadyInitialized));
-  }
+// Commands evaluated per Engine::HandleBatch call by ProcessLines.
+const std::size_t kBatchSize = 64;
 
-  output["account"] = user_json;
+// Everything the command line selects.
+struct Options {
+  const char *input_path = nullptr;
+  // 0 runs everything on this thread.
+  std::size_t threads = 0;
+  // 0 means as many as threads.
+  std::size_t parsers = 0;
+  bool ordered = true;
+  const char *wal_path = nullptr;
+  std::size_t commit_records = WriteAheadLog::kDefaultCommitRecords;
+  std::size_t commit_micros = WriteAheadLog::kDefaultCommitMicros;
+  const char *snapshot_path = nullptr;
+  // Commands between snapshots; 0 only takes one at the end.
+  std::size_t snapshot_every = 0;
+  // Whether periodic snapshots are written by a forked child.
+  bool snapshot_fork = false;
+  // Rebuild the state from the whole log instead of handling input.
+  bool recover = false;
+};
 
-  std::cout << output.dump() << "\n";
+// Commands handled between checks whether a snapshot child is done.
+const std::size_t kSnapshotPollEvery = 4096;
+
+void ReportSnapshotFailure(const Options &options) {
+  std::cerr << options.snapshot_path << ": " << std::strerror(errno) << "\n";
 }
 
-void HandleTransactionCreation(nlohmann::json transaction_json) {
-  // std::cout << "Handling transaction creation\n";
-  nlohmann::json output;
-  output["violations"] = std::vector<std::string>();
-
-  // If no registered user.
-  if (users.size() == 0) {
-    output["violations"].push_back(ErrorToViolation(kAccountNotInitialized));
-  } else {
-    // Set the current user to the only registered user for now and set output.
-    User &current_user = users[0];
-
-    // If user card is not active.
-    if (!current_user.account["active-card"]) {
-      output["violations"].push_back(ErrorToViolation(kCardNotActive));
-    }
+// Writes a snapshot of engine if options ask for one, reporting failures.
+// The log still has every change, so a failed snapshot is not fatal.
+void Snapshot(const Options &options, const Engine &engine,
+              WriteAheadLog *log) {
+  if (options.snapshot_path != nullptr &&
+      !WriteSnapshot(options.snapshot_path, engine, log))
+    ReportSnapshotFailure(options);
+}
 
-    // If not enough funds in account.
-    if (current_user.account["available-limit"] < transaction_json["amount"]) {
-      output["violations"].push_back(ErrorToViolation(kInsufficientLimit));
-    }
+// Starts a child writing a snapshot of engine, unless the previous one is
+// still busy; the loop goes on meanwhile.
+void ForkSnapshot(const Options &options, const Engine &engine,
+                  WriteAheadLog *log, ForkedSnapshot &child) {
+  if (!child.Poll())
+    ReportSnapshotFailure(options);
+  if (!child.running() &&
+      !child.Start(options.snapshot_path, log, [&](SnapshotFile &file) {
+        file.Add(engine);
+      }))
+    ReportSnapshotFailure(options);
+}
 
-    // If too frequent.
-    if (IsTransactionFrequent(current_user.sequentialTransactions,
-                              transaction_json)) {
-      output["violations"].push_back(
-          ErrorToViolation(kHighFrequencySmallInterval));
-    }
+// Handles every line from reader, in order, writing the responses to
+// std::cout. Reader is LineReader or MappedLineReader. Commands are
+// evaluated in batches, except when someone is reading interactively and
+// expects each response before typing the next line. Responses are only
+// written once log, if given, holds the changes they report. Returns false,
+// without writing the final snapshot, if reading failed.
+template <typename Reader>
+bool ProcessLines(Reader &reader, Engine &engine, WriteAheadLog *log,
+                  const Options &options) {
+  // Decoded message and commands, reused for every batch.
+  LineView line;
+  Message incoming;
+  Command commands[kBatchSize];
+  Response responses[kBatchSize];
+  std::size_t count = 0;
+  // Responses are batched unless someone is reading them interactively.
+  const bool interactive = isatty(STDOUT_FILENO);
+  const std::size_t batch_size = interactive ? 1 : kBatchSize;
+  std::size_t since_snapshot = 0;
+  std::size_t since_poll = 0;
+  ForkedSnapshot child;
 
-    // If duplicate.
-    if (IsTransactionSimilar(current_user.specificTransactions,
-                             transaction_json)) {
-      output["violations"].push_back(ErrorToViolation(kDoubledTransaction));
+  bool more = true;
+  while (more) {
+    more = reader.NextLine(line);
+    // Lines that are not valid JSON, match neither schema or carry a bad
+    // time are skipped.
+    if (more &&
+        DecodeCommand(line.data, line.size, incoming, commands[count]))
+      ++count;
+    if (count == batch_size || (!more && count > 0)) {
+      engine.HandleBatch(commands, count, responses);
+      for (std::size_t i = 0; i < count; ++i)
+        writer.AppendResponse(responses[i]);
+      since_snapshot += count;
+      since_poll += count;
+      count = 0;
+      if (interactive || writer.Full())
+        Flush(log);
+      if (options.snapshot_every != 0 &&
+          since_snapshot >= options.snapshot_every) {
+        if (options.snapshot_fork)
+          ForkSnapshot(options, engine, log, child);
+        else
+          Snapshot(options, engine, log);
+        since_snapshot = 0;
+      } else if (since_poll >= kSnapshotPollEvery) {
+        if (!child.Poll())
+          ReportSnapshotFailure(options);
+        since_poll = 0;
+      }
     }
+  }
+  Flush(log);
+  if (!child.Wait())
+    ReportSnapshotFailure(options);
+  if (reader.error() != 0)
+    return false;
+  Snapshot(options, engine, log);
+  return true;
+}
 
-    // Accept transaction.
-    if (output["violations"].empty()) {
-      // Add transactions to user profile.
-      current_user.sequentialTransactions.push_back(transaction_json);
+// Says how much of a record torn by a crash was cut off the log, if any.
+void ReportTruncation(const Options &options, const RestoreStats &stats) {
+  if (stats.truncated != 0)
+    std::cerr << options.wal_path << ": cut off " << stats.truncated
+              << " bytes of a record torn by a crash\n";
+}
 
-      // Get hash of transaction and add to transaction-specifit data structure.
-      for (auto &el : transaction_json.items()) {
-        if (el.key() != "time") {
-          ss << el.key() << ":" << el.value() << ":";
-        }
-      }
-      current_user.specificTransactions[ss.str()].push_back(transaction_json);
+// Rebuilds the state of the previous run into target from the snapshot and
+// log of options, then opens the log for appending. Returns false after
+// reporting why it could not.
+template <typename Target>
+bool Start(const Options &options, Target &target, WriteAheadLog *log) {
+  RestoreStats stats;
+  std::string error;
+  if (!Restore(options.snapshot_path, options.wal_path, target, stats,
+               error)) {
+    std::cerr << error << "\n";
+    return false;
+  }
+  ReportTruncation(options, stats);
+  if (log != nullptr && !log->Open(options.wal_path)) {
+    std::cerr << options.wal_path << ": " << std::strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
 
-      // Reset the stream and clear the error state.
-      std::stringstream().swap(ss);
+void ReportReadFailure(const Options &options, int error) {
+  std::cerr << (options.input_path != nullptr ? options.input_path : "stdin")
+            << ": " << std::strerror(error) << "\n";
+}
 
-      // Update account balance to user.
-      current_user.account["available-limit"] =
-          (unsigned long long)current_user.account["available-limit"] -
-          (unsigned long long)transaction_json["amount"];
+// Runs the single threaded loop or the pipeline over reader. Returns the
+// exit status.
+template <typename Reader> int Process(Reader &reader, const Options &options) {
+  std::unique_ptr<WriteAheadLog> log;
+  if (options.wal_path != nullptr)
+    log.reset(new WriteAheadLog(options.commit_records, options.commit_micros));
+  if (options.threads == 0) {
+    Engine engine(log.get());
+    if (!Start(options, engine, log.get()))
+      return 1;
+    if (!ProcessLines(reader, engine, log.get(), options)) {
+      ReportReadFailure(options, reader.error());
+      return 1;
     }
+    return 0;
+  }
+  Pipeline pipeline(options.threads, options.parsers, std::cout,
+                    options.ordered, Pipeline::kDefaultLineCapacity,
+                    log.get());
+  if (!Start(options, pipeline.engine(), log.get()))
+    return 1;
+  if (options.snapshot_path != nullptr)
+    pipeline.SnapshotEvery(options.snapshot_path, options.snapshot_every,
+                           options.snapshot_fork);
+  if (!pipeline.Run(reader)) {
+    ReportReadFailure(options, reader.error());
+    return 1;
+  }
+  return 0;
+}
 
-    // Set account details as output json.
-    output["account"] = current_user.account;
+// Rebuilds the state from the whole log of options on options.threads
+// shards (one per core if 0), checks it against the snapshot, if any, and
+// replaces that with a snapshot at the end of the log. Returns the exit
+// status.
+int Recover(const Options &options) {
+  std::size_t threads = options.threads;
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  WriteAheadLog log(options.commit_records, options.commit_micros);
+  ShardedEngine engine(threads, std::cout, true,
+                       ShardedEngine::kDefaultQueueCapacity,
+                       ShardedEngine::kDefaultReorderCapacity, &log);
+  RestoreStats stats;
+  std::uint64_t digest;
+  std::string error;
+  if (!RecoverFromLog(options.snapshot_path, options.wal_path, engine, stats,
+                      digest, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  ReportTruncation(options, stats);
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)digest);
+  std::cerr << "replayed " << stats.replayed << " changes on " << threads
+            << (threads == 1 ? " thread" : " threads") << ", state digest "
+            << hex << "\n";
+  if (options.snapshot_path == nullptr)
+    return 0;
+  if (!log.Open(options.wal_path) || !engine.Snapshot(options.snapshot_path)) {
+    std::cerr << options.snapshot_path << ": " << std::strerror(errno)
+              << "\n";
+    return 1;
   }
-  std::cout << output.dump() << "\n";
+  return 0;
 }
 
-int main() {
-  // Placeholder string and json obj.
-  std::string s;
-  nlohmann::json incoming_json;
+// Upper bound for --threads and --parsers, far above any core count worth
+// using.
+const std::size_t kMaxThreads = 1024;
 
-  while (std::getline(std::cin, s)) {
-    incoming_json = nlohmann::json::parse(s);
-    if (incoming_json.contains("account")) {
-      HandleAccountCreation(incoming_json["account"]);
+// Upper bound for the group commit settings: a million records or a second.
+const std::size_t kMaxCommitSetting = 1000000;
+
+// Upper bound for --snapshot-every.
+const std::size_t kMaxSnapshotEvery = 1000000000000ULL;
+
+// Parses a decimal flag value in [min, max].
+bool ParseCount(const char *text, std::size_t min, std::size_t max,
+                std::size_t &count) {
+  char *end;
+  errno = 0;
+  const unsigned long value = std::strtoul(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || *text == '-' ||
+      value < min || value > max)
+    return false;
+  count = value;
+  return true;
+}
+
+// Parses a --threads or --parsers value, accepting 1 to kMaxThreads.
+bool ParseThreadCount(const char *text, std::size_t &threads) {
+  return ParseCount(text, 1, kMaxThreads, threads);
+}
+
+void PrintUsage(const char *program) {
+  std::cerr << "usage: " << program
+            << " [--input <file>] [--threads <n> [--parsers <n>] "
+               "[--unordered]]\n"
+            << "       [--wal <file> [--wal-commit-records <n>] "
+               "[--wal-commit-us <n>]]\n"
+            << "       [--snapshot <file> [--snapshot-every <n>] "
+               "[--snapshot-fork]]\n"
+            << "       " << program
+            << " --recover --wal <file> [--snapshot <file>] "
+               "[--threads <n>]\n"
+            << "  Reads operations from stdin, or from <file> through a "
+               "memory mapping\n"
+            << "    (a pipe or device <file> is read like stdin).\n"
+            << "  --threads <n> spreads accounts over n worker threads "
+               "(1 to " << kMaxThreads << "),\n"
+            << "    with reading, decoding and writing on threads of their "
+               "own.\n"
+            << "  --parsers <n> sets the number of decoding threads "
+               "(default: same as\n"
+            << "    --threads).\n"
+            << "  --unordered writes responses as soon as they are ready, "
+               "tagged with\n"
+            << "    \"seq\", their position in input order counting from "
+               "0.\n"
+            << "  --wal <file> appends every change to account state to "
+               "<file> and only\n"
+            << "    writes a response once its change is on disk. Changes "
+               "are synced in\n"
+            << "    groups, once --wal-commit-records are pending (default "
+            << WriteAheadLog::kDefaultCommitRecords << ") or the oldest\n"
+            << "    has waited --wal-commit-us microseconds (default "
+            << WriteAheadLog::kDefaultCommitMicros << ").\n"
+            << "  --snapshot <file> starts from the snapshot in <file>, if "
+               "any, plus what\n"
+            << "    --wal logged after it, and writes a new one at the end "
+               "of input (and\n"
+            << "    every --snapshot-every <n> commands).\n"
+            << "  --snapshot-fork writes the periodic snapshots from a "
+               "forked child process\n"
+            << "    while processing goes on.\n"
+            << "  --recover reads no input: it replays the whole of --wal "
+               "on --threads threads\n"
+            << "    (default: one per core), checks the result against "
+               "--snapshot, if any,\n"
+            << "    and writes a new snapshot there.\n";
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  bool commit_settings = false;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--input" && i + 1 < argc) {
+      options.input_path = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc &&
+               ParseThreadCount(argv[++i], options.threads)) {
+      continue;
+    } else if (arg == "--parsers" && i + 1 < argc &&
+               ParseThreadCount(argv[++i], options.parsers)) {
+      continue;
+    } else if (arg == "--unordered") {
+      options.ordered = false;
+    } else if (arg == "--wal" && i + 1 < argc) {
+      options.wal_path = argv[++i];
+    } else if (arg == "--wal-commit-records" && i + 1 < argc &&
+               ParseCount(argv[++i], 1, kMaxCommitSetting,
+                          options.commit_records)) {
+      commit_settings = true;
+    } else if (arg == "--wal-commit-us" && i + 1 < argc &&
+               ParseCount(argv[++i], 0, kMaxCommitSetting,
+                          options.commit_micros)) {
+      commit_settings = true;
+    } else if (arg == "--snapshot" && i + 1 < argc) {
+      options.snapshot_path = argv[++i];
+    } else if (arg == "--snapshot-every" && i + 1 < argc &&
+               ParseCount(argv[++i], 1, kMaxSnapshotEvery,
+                          options.snapshot_every)) {
+      continue;
+    } else if (arg == "--snapshot-fork") {
+      options.snapshot_fork = true;
+    } else if (arg == "--recover") {
+      options.recover = true;
     } else {
-      HandleTransactionCreation(incoming_json["transaction"]);
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  // The single threaded loop has no parsers and is always in order.
+  if ((!options.ordered || options.parsers != 0) && options.threads == 0) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  if ((commit_settings && options.wal_path == nullptr) ||
+      ((options.snapshot_every != 0 || options.snapshot_fork) &&
+       options.snapshot_path == nullptr)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  // Recovery only takes the log, the snapshot and the thread count.
+  if (options.recover) {
+    if (options.wal_path == nullptr || options.input_path != nullptr ||
+        !options.ordered || options.parsers != 0 ||
+        options.snapshot_every != 0 || options.snapshot_fork) {
+      PrintUsage(argv[0]);
+      return 1;
     }
+    return Recover(options);
   }
-}
\ No newline at end of file
+
+  if (options.parsers == 0)
+    options.parsers = options.threads;
+
+  if (options.input_path != nullptr) {
+    // Pipes and devices (a FIFO, /dev/stdin) can not be mapped and are read
+    // like stdin instead. stat does not open them, which for a FIFO would
+    // wait for a writer.
+    struct stat st;
+    if (stat(options.input_path, &st) == 0 && !S_ISREG(st.st_mode)) {
+      const int fd = open(options.input_path, O_RDONLY);
+      if (fd < 0) {
+        std::cerr << options.input_path << ": " << std::strerror(errno)
+                  << "\n";
+        return 1;
+      }
+      LineReader reader(fd);
+      const int status = Process(reader, options);
+      close(fd);
+      return status;
+    }
+    MappedLineReader reader;
+    if (!reader.Open(options.input_path)) {
+      std::cerr << options.input_path << ": " << std::strerror(errno)
+                << "\n";
+      return 1;
+    }
+    return Process(reader, options);
+  }
+  LineReader reader(STDIN_FILENO);
+  return Process(reader, options);
+}